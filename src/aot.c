@@ -0,0 +1,605 @@
+// Translating compiled scripts to C, and running the result.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "include/aot.h"
+#include "include/cache.h"
+#include "include/compiler.h"
+#include "include/memory.h"
+
+/*
+  Each function's stack lives in C locals s0, s1, ... rather
+  than in vm.stack, so gcc sees a whole body at once. There
+  are no backward jumps, so one pass in code order finds the
+  stack height before every instruction.
+
+  Anything that may allocate, push a frame or report an error
+  spills the locals to the frame's slots first. Instructions
+  left to run() return JIT_STEP, and the entry switch reloads
+  the locals when run() calls back in after them.
+*/
+
+typedef struct {
+  uint8_t op;
+  bool wide;
+  // An index, slot or jump target, depending on the op.
+  int a;
+  int b;
+  int next;
+} Instruct;
+
+typedef struct {
+  FILE* out;
+  Chunk* chunk;
+  // The stack height before each instruction, -1 if it can't be reached.
+  int* depth;
+  // Jumped to, and run() may call back in at.
+  bool* label;
+  bool* resume;
+  int max_depth;
+} Body;
+
+static int read_short(uint8_t* at) {
+  return (at[0] << 8) | at[1];
+}
+
+static int read_wide(uint8_t* at) {
+  return at[0] | (at[1] << 8) | (at[2] << 16);
+}
+
+static Instruct decode(Chunk* chunk, int offset) {
+  uint8_t* ip = &chunk->code[offset];
+  Instruct in = { ip[0], false, 0, 0, offset + instruct_length(chunk, offset) };
+
+  if (in.op == OP_WIDE) {
+    in.op = ip[1];
+    in.wide = true;
+    in.a = read_wide(ip + 2);
+
+    if (in.op == OP_INVOKE || in.op == OP_INVOKE_SUPER) in.b = ip[5];
+    if (in.op == OP_JUMP || in.op == OP_JUMP_IF_FALSE) in.a += in.next;
+
+    return in;
+  }
+
+  switch (in.op) {
+    case OP_CONSTANT_LONG:
+      in.a = read_wide(ip + 1);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      in.a = in.next + read_short(ip + 1);
+      break;
+    case OP_SWITCH_RANGE:
+    case OP_SWITCH_HASH:
+      break;
+    default:
+      if (in.next - offset > 1) in.a = ip[1];
+      if (in.next - offset > 2) in.b = ip[2];
+      break;
+  }
+  return in;
+}
+
+// Whether the instruction can hand control back to run().
+static bool leaves(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_DUP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_STORE:
+    case OP_MOVE:
+    case OP_LOADK:
+    case OP_GET_FLAT:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_EQU:
+    case OP_EQU_RR:
+    case OP_EQU_RK:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+    case OP_EQU_NUM:
+    case OP_NEGATE_NUM:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static bool reach(Body* body, int offset, int depth) {
+  if (offset >= body->chunk->count) return false;
+
+  if (body->depth[offset] == -1) body->depth[offset] = depth;
+
+  return body->depth[offset] == depth;
+}
+
+static bool reach_target(Body* body, int target, int depth) {
+  if (!reach(body, target, depth)) return false;
+
+  body->label[target] = body->resume[target] = true;
+
+  return true;
+}
+
+// Marks the targets of a switch, which run() takes itself.
+static bool reach_switch(Body* body, int offset, int depth) {
+  uint8_t* ip = &body->chunk->code[offset];
+  int start = (int)(ip - body->chunk->code);
+
+  if (ip[0] == OP_SWITCH_RANGE) {
+    int count = read_short(ip + 3);
+    uint8_t* table = ip + 5;
+    int base = start + 5 + 2 + 2 * count;
+
+    for (int i = 0; i <= count; i++) {
+      if (!reach_target(body, base + read_short(table + 2 * i), depth)) return false;
+    }
+    return true;
+  }
+
+  int capacity = read_short(ip + 1);
+  uint8_t* table = ip + 3;
+  int base = start + 3 + 2 + 4 * capacity;
+
+  if (!reach_target(body, base + read_short(table), depth)) return false;
+
+  for (int i = 0; i < capacity; i++) {
+    uint8_t* entry = table + 2 + 4 * i;
+
+    if (read_short(entry) == SWITCH_EMPTY) continue;
+    if (!reach_target(body, base + read_short(entry + 2), depth)) return false;
+  }
+  return true;
+}
+
+static bool find_depths(Body* body, ObjFunc* function) {
+  Chunk* chunk = body->chunk;
+
+  for (int i = 0; i < chunk->count; i++) body->depth[i] = -1;
+
+  // Frames start at the top or at the copy for numbers.
+  body->depth[0] = body->depth[function->fast_entry] = function->arity + 1;
+  body->label[0] = body->resume[0] = true;
+  body->label[function->fast_entry] = body->resume[function->fast_entry] = true;
+  body->max_depth = function->arity + 1;
+
+  for (int offset = 0; offset < chunk->count;) {
+    Instruct in = decode(chunk, offset);
+    int depth = body->depth[offset];
+    int after = depth + stack_effect(chunk, offset);
+
+    if (depth == -1) {
+      offset = in.next;
+      continue;
+    }
+
+    if (after < 0) return false;
+    if (after > body->max_depth) body->max_depth = after;
+
+    switch (in.op) {
+      case OP_RETURN:
+        break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+        if (!reach(body, in.a, after)) return false;
+
+        body->label[in.a] = true;
+
+        if (in.op == OP_JUMP_IF_FALSE && !reach(body, in.next, after)) return false;
+
+        break;
+      case OP_SWITCH_RANGE:
+      case OP_SWITCH_HASH:
+        if (!reach_switch(body, offset, after)) return false;
+        break;
+      default:
+        if (!reach(body, in.next, after)) return false;
+
+        if (leaves(in.op)) body->label[in.next] = body->resume[in.next] = true;
+
+        break;
+    }
+
+    offset = in.next;
+  }
+  return true;
+}
+
+// Numbers are written out so gcc can fold them.
+static void const_text(Body* body, int index, char* text, size_t size) {
+  Value value = body->chunk->constants.values[index];
+
+  if (IS_NUM(value) && isfinite(AS_NUM(value))) snprintf(text, size, "NUM_VAL(%a)", AS_NUM(value));
+  else snprintf(text, size, "AOT_CONST(%d)", index);
+}
+
+static void emit_const(Body* body, int index) {
+  char text[64];
+
+  const_text(body, index, text, sizeof(text));
+  fprintf(body->out, "%s", text);
+}
+
+static void emit_spill(Body* body, int depth) {
+  for (int i = 0; i < depth; i++) {
+    fprintf(body->out, "%sslots[%d] = s%d;", i == 0 ? "" : " ", i, i);
+  }
+}
+
+// Spills `depth` values and returns `status` with frame->ip at `offset`.
+static void emit_leave(Body* body, const char* indent, int offset, int depth, const char* status) {
+  fprintf(body->out, "%s", indent);
+  emit_spill(body, depth);
+  fprintf(body->out, "%sAOT_SYNC(%d, %d); return %s;\n", depth > 0 ? " " : "", offset, depth, status);
+}
+
+// A number-only fast path, with anything else left to run().
+static void emit_numeric(Body* body, int offset, int depth, const char* result, const char* left,
+    const char* right, const char* value_type, char op) {
+  FILE* out = body->out;
+
+  fprintf(out, "  if (IS_NUM(%s) && IS_NUM(%s)) ", left, right);
+  fprintf(out, "%s = %s(AS_NUM(%s) %c AS_NUM(%s));\n", result, value_type, left, op, right);
+  fprintf(out, "  else {\n");
+  emit_leave(body, "    ", offset, depth, "JIT_STEP");
+  fprintf(out, "  }\n");
+}
+
+static char binary_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD: case OP_ADD_RR: case OP_ADD_RK: return '+';
+    case OP_SUB: case OP_SUB_RR: case OP_SUB_RK: return '-';
+    case OP_MUL: case OP_MUL_RR: case OP_MUL_RK: return '*';
+    case OP_DIV: case OP_DIV_RR: case OP_DIV_RK: return '/';
+    case OP_LESS: case OP_LESS_RR: case OP_LESS_RK: return '<';
+    default: return '>';
+  }
+}
+
+static const char* num_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUM: return "+";
+    case OP_SUB_NUM: return "-";
+    case OP_MUL_NUM: return "*";
+    case OP_DIV_NUM: return "/";
+    case OP_LESS_NUM: return "<";
+    case OP_GREATER_NUM: return ">";
+    default: return "==";
+  }
+}
+
+static void emit_instruct(Body* body, int offset) {
+  FILE* out = body->out;
+  Instruct in = decode(body->chunk, offset);
+  int d = body->depth[offset];
+  char left[32];
+  char right[64];
+
+  switch (in.op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      fprintf(out, "  s%d = ", d);
+      emit_const(body, in.a);
+      fprintf(out, ";\n");
+      return;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      fprintf(out, "  s%d = %s;\n", d,
+        in.op == OP_NIL ? "NIL_VAL" : in.op == OP_TRUE ? "BOOL_VAL(true)" : "BOOL_VAL(false)");
+      return;
+    case OP_POP:
+      return;
+    case OP_DUP:
+      fprintf(out, "  s%d = s%d;\n", d, d - 1);
+      return;
+    case OP_GET_LOCAL:
+      fprintf(out, "  s%d = s%d;\n", d, in.a);
+      return;
+    case OP_SET_LOCAL:
+    case OP_STORE:
+      fprintf(out, "  s%d = s%d;\n", in.a, d - 1);
+      return;
+    case OP_MOVE:
+      fprintf(out, "  s%d = s%d;\n", in.a, in.b);
+      return;
+    case OP_LOADK:
+      fprintf(out, "  s%d = ", in.a);
+      emit_const(body, in.b);
+      fprintf(out, ";\n");
+      return;
+    case OP_GET_FLAT:
+      fprintf(out, "  s%d = frame->closure->upvals[%d];\n", d, in.a);
+      return;
+    // Upvalues point into frames further down, which are spilled.
+    case OP_GET_UPVAL:
+      fprintf(out, "  s%d = *AS_UPVAL(frame->closure->upvals[%d])->location;\n", d, in.a);
+      return;
+    case OP_SET_UPVAL:
+      fprintf(out, "  *AS_UPVAL(frame->closure->upvals[%d])->location = s%d;\n", in.a, d - 1);
+      return;
+    case OP_EQU:
+      fprintf(out, "  s%d = BOOL_VAL(aot_equ(s%d, s%d));\n", d - 2, d - 2, d - 1);
+      return;
+    case OP_EQU_RR:
+      fprintf(out, "  s%d = BOOL_VAL(aot_equ(s%d, s%d));\n", d, in.a, in.b);
+      return;
+    case OP_EQU_RK:
+      fprintf(out, "  s%d = BOOL_VAL(aot_equ(s%d, ", d, in.a);
+      emit_const(body, in.b);
+      fprintf(out, "));\n");
+      return;
+    case OP_NOT:
+      fprintf(out, "  s%d = BOOL_VAL(aot_falsey(s%d));\n", d - 1, d - 1);
+      return;
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+    case OP_EQU_NUM:
+      fprintf(out, "  s%d = %s(AS_NUM(s%d) %s AS_NUM(s%d));\n", d - 2,
+        in.op >= OP_LESS_NUM ? "BOOL_VAL" : "NUM_VAL", d - 2, num_op(in.op), d - 1);
+      return;
+    case OP_NEGATE_NUM:
+      fprintf(out, "  s%d = NUM_VAL(-AS_NUM(s%d));\n", d - 1, d - 1);
+      return;
+    case OP_PRINT:
+      fprintf(out, "  print_val(s%d);\n  printf(\"\\n\");\n", d - 1);
+      return;
+    case OP_JUMP:
+      fprintf(out, "  goto L%d;\n", in.a);
+      return;
+    case OP_JUMP_IF_FALSE:
+      fprintf(out, "  if (aot_falsey(s%d)) goto L%d;\n", d - 1, in.a);
+      return;
+    case OP_NEGATE:
+      fprintf(out, "  if (IS_NUM(s%d)) s%d = NUM_VAL(-AS_NUM(s%d));\n  else {\n", d - 1, d - 1, d - 1);
+      emit_leave(body, "    ", offset, d, "JIT_STEP");
+      fprintf(out, "  }\n");
+      return;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LESS:
+    case OP_GREATER:
+      snprintf(left, sizeof(left), "s%d", d - 2);
+      snprintf(right, sizeof(right), "s%d", d - 1);
+      emit_numeric(body, offset, d, left, left, right,
+        in.op == OP_LESS || in.op == OP_GREATER ? "BOOL_VAL" : "NUM_VAL", binary_op(in.op));
+      return;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+    case OP_LESS_RR:
+    case OP_GREATER_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+    case OP_LESS_RK:
+    case OP_GREATER_RK: {
+      bool rk = in.op == OP_ADD_RK || in.op == OP_SUB_RK || in.op == OP_MUL_RK ||
+        in.op == OP_DIV_RK || in.op == OP_LESS_RK || in.op == OP_GREATER_RK;
+      bool compare = in.op == OP_LESS_RR || in.op == OP_LESS_RK ||
+        in.op == OP_GREATER_RR || in.op == OP_GREATER_RK;
+      char result[32];
+
+      snprintf(result, sizeof(result), "s%d", d);
+      snprintf(left, sizeof(left), "s%d", in.a);
+
+      if (rk) const_text(body, in.b, right, sizeof(right));
+      else snprintf(right, sizeof(right), "s%d", in.b);
+
+      emit_numeric(body, offset, d, result, left, right, compare ? "BOOL_VAL" : "NUM_VAL", binary_op(in.op));
+      return;
+    }
+    case OP_GET_GLOBAL:
+    case OP_GET_PROP: {
+      int top = in.op == OP_GET_GLOBAL ? d : d - 1;
+
+      fprintf(out, "  ");
+      emit_spill(body, d);
+      fprintf(out, "%sAOT_SYNC(%d, %d);\n", d > 0 ? " " : "", in.next, d);
+      fprintf(out, "  if (!%s(AS_STRING(AOT_CONST(%d)))) return JIT_ERROR;\n",
+        in.op == OP_GET_GLOBAL ? "jit_get_global" : "jit_get_prop", in.a);
+      fprintf(out, "  s%d = slots[%d];\n", top, top);
+      return;
+    }
+    case OP_CALL:
+    case OP_CALL_0:
+    case OP_CALL_1:
+    case OP_CALL_2:
+    case OP_CALL_3:
+    case OP_INVOKE: {
+      int arg_count = in.op == OP_CALL ? in.a : in.op == OP_INVOKE ? in.b : in.op - OP_CALL_0;
+      int callee = d - arg_count - 1;
+
+      fprintf(out, "  ");
+      emit_spill(body, d);
+      fprintf(out, " AOT_SYNC(%d, %d);\n", in.next, d);
+
+      if (in.op == OP_INVOKE) {
+        fprintf(out, "  switch (jit_invoke(AS_STRING(AOT_CONST(%d)), %d)) {\n", in.a, arg_count);
+      }
+      else {
+        fprintf(out, "  switch (jit_call(%d)) {\n", arg_count);
+      }
+
+      fprintf(out, "    case 0: return JIT_ERROR;\n    case 2: return JIT_SWITCH;\n  }\n");
+      fprintf(out, "  s%d = slots[%d];\n", callee, callee);
+      return;
+    }
+    default:
+      emit_leave(body, "  ", offset, d, "JIT_STEP");
+      return;
+  }
+}
+
+static void emit_body(Body* body, ObjFunc* function, int index) {
+  FILE* out = body->out;
+  Chunk* chunk = body->chunk;
+
+  if (function->name == NULL) fprintf(out, "// The script.\n");
+  else fprintf(out, "// %.*s\n", function->name->length, function->name->chars);
+
+  fprintf(out, "static int nvm_fn%d(CallFrame* frame) {\n", index);
+  fprintf(out, "  Value* slots = frame->slots;\n");
+
+  for (int i = 0; i < body->max_depth; i++) {
+    fprintf(out, "%s s%d = NIL_VAL", i == 0 ? "  Value" : ",", i);
+  }
+  fprintf(out, ";\n\n  switch (frame->ip - AOT_AT(0)) {\n");
+
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (!body->resume[offset] || body->depth[offset] == -1) continue;
+
+    fprintf(out, "    case %d:", offset);
+
+    for (int i = 0; i < body->depth[offset]; i++) fprintf(out, " s%d = slots[%d];", i, i);
+
+    fprintf(out, " goto L%d;\n", offset);
+  }
+  fprintf(out, "    default: return JIT_STEP;\n  }\n\n");
+
+  for (int offset = 0; offset < chunk->count; offset += instruct_length(chunk, offset)) {
+    if (body->depth[offset] == -1) continue;
+
+    if (body->label[offset]) fprintf(out, "L%d: ;\n", offset);
+
+    emit_instruct(body, offset);
+  }
+
+  fprintf(out, "}\n\n");
+}
+
+// Emits the functions in the order the cache writes them, numbered from `*count`.
+static void emit_func(FILE* out, ObjFunc* function, int* count) {
+  Chunk* chunk = &function->chunk;
+  int index = (*count)++;
+  Body body = { out, chunk, NULL, NULL, NULL, 0 };
+
+  if (chunk->count > 0) {
+    body.depth = ALLOCATE(int, chunk->count);
+    body.label = ALLOCATE(bool, chunk->count);
+    body.resume = ALLOCATE(bool, chunk->count);
+
+    for (int i = 0; i < chunk->count; i++) body.label[i] = body.resume[i] = false;
+
+    // A body the analysis can't follow is left to the interpreter.
+    if (find_depths(&body, function)) emit_body(&body, function, index);
+    else fprintf(out, "#define nvm_fn%d NULL\n\n", index);
+
+    FREE_ARRAY(int, body.depth, chunk->count);
+    FREE_ARRAY(bool, body.label, chunk->count);
+    FREE_ARRAY(bool, body.resume, chunk->count);
+  }
+  else {
+    fprintf(out, "#define nvm_fn%d NULL\n\n", index);
+  }
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+
+    if (IS_FUNC(value)) emit_func(out, AS_FUNC(value), count);
+    else if (IS_CLOSURE(value)) emit_func(out, AS_CLOSURE(value)->function, count);
+  }
+}
+
+bool emit_c(ObjFunc* script, const char* path) {
+  size_t size = 0;
+  uint32_t options = compile_options();
+  uint8_t* image = cache_image(script, 0, options, &size);
+
+  if (image == NULL) return false;
+
+  FILE* out = fopen(path, "w");
+
+  if (out == NULL) {
+    free(image);
+    return false;
+  }
+
+  fprintf(out, "// Generated by `nvmbrc --emit-c`. Link it with libnvmbr.a.\n\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+  fprintf(out, "static _Alignas(8) const uint8_t nvm_image[] = {");
+
+  for (size_t i = 0; i < size; i++) {
+    fprintf(out, "%s0x%02x,", i % 16 == 0 ? "\n  " : " ", image[i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  free(image);
+
+  int count = 0;
+
+  // The scratch arrays can set off a collection.
+  push(OBJ_VAL(script));
+  emit_func(out, script, &count);
+  pop();
+
+  fprintf(out, "static const AotFn nvm_bodies[] = {");
+
+  for (int i = 0; i < count; i++) fprintf(out, "%s nvm_fn%d", i == 0 ? "" : ",", i);
+
+  fprintf(out, " };\n\nint main() {\n");
+  fprintf(out, "  return aot_main(nvm_image, sizeof(nvm_image), 0x%x, nvm_bodies, %d);\n}\n", options, count);
+
+  return fclose(out) == 0;
+}
+
+// Gives each function its body, in the order emit_func numbered them.
+static void attach(ObjFunc* function, const AotFn* bodies, int body_count, int* next) {
+  if (*next < body_count) function->aot = bodies[*next];
+
+  (*next)++;
+
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value value = function->chunk.constants.values[i];
+
+    if (IS_FUNC(value)) attach(AS_FUNC(value), bodies, body_count, next);
+    else if (IS_CLOSURE(value)) attach(AS_CLOSURE(value)->function, bodies, body_count, next);
+  }
+}
+
+int aot_main(const uint8_t* image, size_t size, uint32_t options, const AotFn* bodies, int body_count) {
+  init_vm();
+
+  ObjFunc* script = load_image(image, size, 0, options);
+
+  if (script == NULL) {
+    fprintf(stderr, "This program was built for another version of NVMbr.\n");
+    return 70;
+  }
+
+  int next = 0;
+
+  attach(script, bodies, body_count, &next);
+  vm.aot = true;
+
+  InterpResult result = interp_func(script);
+
+  if (result == INTERP_COMPILE_ERR) return 65;
+  if (result == INTERP_RUNTIME_ERR) return 70;
+
+  return 0;
+}
@@ -0,0 +1,482 @@
+// Saving compiled scripts so they don't have to be compiled again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#include <process.h>
+#endif
+#include "include/cache.h"
+#include "include/memory.h"
+#include "include/optimize.h"
+#include "include/vm.h"
+
+/*
+  A .nvmc file is a header followed by the script function,
+  written depth first:
+
+    header    "NVMC", u32 version, u64 source hash, u32 options
+    function  i32 arity, i32 upval_count, i32 fast_entry,
+              i32 max_stack, name,
+              i32 code count, code bytes, pad to 4,
+              i32 line count, LineStart entries,
+              i32 constant count, constants
+    name      i32 length (-1 for none), bytes
+    constant  u8 tag, then a double, a name, a function, or
+              nothing for nil, false and true
+
+  Everything is in the byte order of the machine that wrote
+  it. Code and line tables are used straight from the mapped
+  file instead of being copied, which is why they are padded.
+*/
+
+#define CACHE_MAGIC "NVMC"
+
+typedef enum {
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+  // A closure without upvalues, shared by every run of its declaration.
+  CONST_CLOSURE,
+  // Left behind by constant folding, with nothing after the tag.
+  CONST_NIL,
+  CONST_FALSE,
+  CONST_TRUE,
+} ConstTag;
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Writer;
+
+typedef struct {
+  const uint8_t* start;
+  const uint8_t* at;
+  const uint8_t* end;
+} Reader;
+
+// The mapping borrowed chunks point into.
+static uint8_t* cache_bytes = NULL;
+static size_t cache_size = 0;
+
+uint64_t hash_source(const char* src, size_t length) {
+  // 64-bit FNV-1a.
+  uint64_t hash = 14695981039346656037u;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)src[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static void write_bytes(Writer* writer, const void* bytes, size_t count) {
+  if (writer->count + count > writer->capacity) {
+    while (writer->count + count > writer->capacity) {
+      writer->capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+    }
+
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+
+    if (writer->bytes == NULL) {
+      fprintf(stderr, "Not enough memory to write the cache.\n");
+      exit(74);
+    }
+  }
+
+  memcpy(writer->bytes + writer->count, bytes, count);
+  writer->count += count;
+}
+
+static void write_int(Writer* writer, int32_t value) {
+  write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_pad(Writer* writer) {
+  static const uint8_t zeros[4] = { 0 };
+
+  write_bytes(writer, zeros, (4 - writer->count % 4) % 4);
+}
+
+static void write_name(Writer* writer, ObjString* name) {
+  if (name == NULL) {
+    write_int(writer, -1);
+    return;
+  }
+
+  write_int(writer, name->length);
+  write_bytes(writer, name->chars, name->length);
+}
+
+static bool write_func(Writer* writer, ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+
+  if (function->lazy != NULL) return false;
+
+  write_int(writer, function->arity);
+  write_int(writer, function->upval_count);
+  write_int(writer, function->fast_entry);
+  write_int(writer, function->max_stack);
+  write_name(writer, function->name);
+
+  write_int(writer, chunk->count);
+  write_bytes(writer, chunk->code, chunk->count);
+  write_pad(writer);
+
+  write_int(writer, chunk->line_count);
+  write_bytes(writer, chunk->lines, sizeof(LineStart) * chunk->line_count);
+
+  write_int(writer, chunk->constants.count);
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+
+    if (IS_NUM(value)) {
+      double number = AS_NUM(value);
+
+      write_bytes(writer, &(uint8_t){ CONST_NUMBER }, 1);
+      write_bytes(writer, &number, sizeof(number));
+    }
+    else if (IS_STRING(value)) {
+      write_bytes(writer, &(uint8_t){ CONST_STRING }, 1);
+      write_name(writer, AS_STRING(value));
+    }
+    else if (IS_NIL(value) || IS_BOOL(value)) {
+      write_bytes(writer, &(uint8_t){ IS_NIL(value) ? CONST_NIL : AS_BOOL(value) ? CONST_TRUE : CONST_FALSE }, 1);
+    }
+    else if (IS_FUNC(value) || IS_CLOSURE(value)) {
+      write_bytes(writer, &(uint8_t){ IS_FUNC(value) ? CONST_FUNCTION : CONST_CLOSURE }, 1);
+      write_pad(writer);
+
+      if (!write_func(writer, IS_FUNC(value) ? AS_FUNC(value) : AS_CLOSURE(value)->function)) return false;
+    }
+    else {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool write_image(Writer* writer, ObjFunc* function, uint64_t src_hash, uint32_t options) {
+  uint32_t version = NVM_BYTECODE_VERSION;
+
+  write_bytes(writer, CACHE_MAGIC, 4);
+  write_bytes(writer, &version, sizeof(version));
+  write_bytes(writer, &src_hash, sizeof(src_hash));
+  write_bytes(writer, &options, sizeof(options));
+
+  return write_func(writer, function);
+}
+
+uint8_t* cache_image(ObjFunc* function, uint64_t src_hash, uint32_t options, size_t* size) {
+  Writer writer = { NULL, 0, 0 };
+
+  if (!write_image(&writer, function, src_hash, options)) {
+    free(writer.bytes);
+    return NULL;
+  }
+
+  *size = writer.count;
+
+  return writer.bytes;
+}
+
+static bool sync_file(FILE* file) {
+  if (fflush(file) != 0) return false;
+
+#ifndef _WIN32
+  return fsync(fileno(file)) == 0;
+#else
+  return _commit(_fileno(file)) == 0;
+#endif
+}
+
+/*
+  The file is written whole under another name and renamed
+  over the old one, so a process that has the old one mapped
+  keeps it, and a crash never leaves half a file behind.
+*/
+bool write_cache(ObjFunc* function, const char* path, uint64_t src_hash, uint32_t options) {
+  Writer writer = { NULL, 0, 0 };
+  bool written = write_image(&writer, function, src_hash, options);
+  size_t length = strlen(path) + 32;
+  char* temp_path = malloc(length);
+
+  if (written && temp_path != NULL) {
+#ifndef _WIN32
+    snprintf(temp_path, length, "%s.tmp.%ld", path, (long)getpid());
+#else
+    snprintf(temp_path, length, "%s.tmp.%ld", path, (long)_getpid());
+#endif
+    FILE* file = fopen(temp_path, "wb");
+
+    written = file != NULL && fwrite(writer.bytes, 1, writer.count, file) == writer.count && sync_file(file);
+
+    if (file != NULL && fclose(file) != 0) written = false;
+
+#ifdef _WIN32
+    // rename() won't replace an existing file here.
+    if (written) remove(path);
+#endif
+    if (written && rename(temp_path, path) != 0) written = false;
+    if (!written && file != NULL) remove(temp_path);
+  }
+  else {
+    written = false;
+  }
+
+  free(temp_path);
+  free(writer.bytes);
+
+  return written;
+}
+
+static const void* read_bytes(Reader* reader, size_t count) {
+  if (reader->at == NULL || (size_t)(reader->end - reader->at) < count) {
+    reader->at = NULL;
+    return NULL;
+  }
+
+  const void* bytes = reader->at;
+
+  reader->at += count;
+
+  return bytes;
+}
+
+static int32_t read_int(Reader* reader) {
+  int32_t value = 0;
+  const void* bytes = read_bytes(reader, sizeof(value));
+
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+
+  return value;
+}
+
+static void read_pad(Reader* reader) {
+  read_bytes(reader, (4 - (reader->at - reader->start) % 4) % 4);
+}
+
+// Reads a name and interns it, or returns NULL for none.
+static ObjString* read_name(Reader* reader) {
+  int32_t length = read_int(reader);
+
+  if (length < 0) return NULL;
+
+  const char* chars = read_bytes(reader, length);
+
+  return chars == NULL ? NULL : copy_string(chars, length);
+}
+
+static ObjFunc* read_func(Reader* reader) {
+  ObjFunc* function = new_func();
+  Chunk* chunk = &function->chunk;
+
+  // Every object below is reachable from the function, so
+  // keeping it on the stack roots the whole tree.
+  push(OBJ_VAL(function));
+
+  function->arity = read_int(reader);
+  function->upval_count = read_int(reader);
+  function->fast_entry = read_int(reader);
+  function->max_stack = read_int(reader);
+  function->name = read_name(reader);
+
+  // Borrowed from the mapping, which a capacity of 0 marks.
+  chunk->count = read_int(reader);
+  chunk->code = (uint8_t*)read_bytes(reader, chunk->count < 0 ? SIZE_MAX : (size_t)chunk->count);
+  read_pad(reader);
+
+  if (function->fast_entry < 0 || (function->fast_entry > 0 && function->fast_entry >= chunk->count) ||
+      function->max_stack < function->arity + 1 || function->max_stack > STACK_MAX) {
+    reader->at = NULL;
+  }
+
+  chunk->line_count = read_int(reader);
+  chunk->lines = (LineStart*)read_bytes(reader,
+    chunk->line_count < 0 ? SIZE_MAX : sizeof(LineStart) * chunk->line_count);
+
+  int32_t const_count = read_int(reader);
+
+  if (reader->at == NULL || const_count < 0 || const_count > reader->end - reader->at) {
+    reader->at = NULL;
+    pop();
+    return function;
+  }
+
+  ValueArray* constants = &chunk->constants;
+
+  constants->values = ALLOCATE(Value, const_count);
+  constants->capacity = const_count;
+
+  while (constants->count < const_count && reader->at != NULL) {
+    const uint8_t* tag = read_bytes(reader, 1);
+    Value value = NIL_VAL;
+
+    if (tag == NULL) break;
+
+    switch (*tag) {
+      case CONST_NUMBER: {
+        double number = 0;
+        const void* bytes = read_bytes(reader, sizeof(number));
+
+        if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+        value = NUM_VAL(number);
+
+        break;
+      }
+      case CONST_STRING: {
+        ObjString* string = read_name(reader);
+
+        if (string == NULL) reader->at = NULL;
+        else value = OBJ_VAL(string);
+
+        break;
+      }
+      case CONST_NIL:
+        break;
+      case CONST_FALSE:
+      case CONST_TRUE:
+        value = BOOL_VAL(*tag == CONST_TRUE);
+        break;
+      case CONST_FUNCTION:
+        read_pad(reader);
+        value = OBJ_VAL(read_func(reader));
+        break;
+      case CONST_CLOSURE: {
+        read_pad(reader);
+
+        ObjFunc* inner = read_func(reader);
+
+        push(OBJ_VAL(inner));
+        value = OBJ_VAL(new_close(inner));
+        pop();
+
+        break;
+      }
+      default:
+        reader->at = NULL;
+        break;
+    }
+
+    constants->values[constants->count++] = value;
+  }
+
+  if (reader->at != NULL) {
+    find_trivial(function);
+    find_live(function);
+  }
+
+  pop();
+
+  return function;
+}
+
+static bool map_file(const char* path) {
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return false;
+
+  struct stat info;
+
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void* bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (bytes == MAP_FAILED) return false;
+
+  cache_bytes = bytes;
+  cache_size = info.st_size;
+
+  return true;
+#else
+  FILE* file = fopen(path, "rb");
+
+  if (file == NULL) return false;
+
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  uint8_t* bytes = size > 0 ? malloc(size) : NULL;
+
+  if (bytes == NULL || fread(bytes, 1, size, file) < (size_t)size) {
+    free(bytes);
+    fclose(file);
+    return false;
+  }
+
+  fclose(file);
+
+  cache_bytes = bytes;
+  cache_size = size;
+
+  return true;
+#endif
+}
+
+ObjFunc* load_image(const uint8_t* bytes, size_t size, uint64_t src_hash, uint32_t options) {
+  Reader reader = { bytes, bytes, bytes + size };
+  const char* magic = read_bytes(&reader, 4);
+  int32_t version = read_int(&reader);
+  uint64_t hash = 0;
+  const void* hash_bytes = read_bytes(&reader, sizeof(hash));
+
+  if (hash_bytes != NULL) memcpy(&hash, hash_bytes, sizeof(hash));
+
+  // Compiled with other options, the code isn't what this run asked for.
+  uint32_t image_options = (uint32_t)read_int(&reader);
+
+  if (reader.at == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0
+      || version != NVM_BYTECODE_VERSION || hash != src_hash || image_options != options) {
+    return NULL;
+  }
+
+  ObjFunc* function = read_func(&reader);
+
+  // A truncated or corrupt image leaves behind a half built
+  // function. It is never run, so it is simply garbage, and
+  // freeing it never touches the borrowed arrays.
+  return reader.at == NULL ? NULL : function;
+}
+
+ObjFunc* load_cache(const char* path, uint64_t src_hash, uint32_t options, bool* stale) {
+  *stale = false;
+
+  // Only one script is ever loaded, so one mapping is enough.
+  if (cache_bytes != NULL || !map_file(path)) return NULL;
+
+  ObjFunc* function = load_image(cache_bytes, cache_size, src_hash, options);
+
+  if (function == NULL) {
+    free_cache();
+    *stale = true;
+  }
+
+  return function;
+}
+
+void free_cache() {
+  if (cache_bytes == NULL) return;
+
+#ifndef _WIN32
+  munmap(cache_bytes, cache_size);
+#else
+  free(cache_bytes);
+#endif
+  cache_bytes = NULL;
+  cache_size = 0;
+}
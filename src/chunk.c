@@ -10,14 +10,19 @@ void init_chunk(Chunk* chunk) {
   chunk->line_count = 0;
   chunk->line_capacity = 0;
 	chunk->lines = NULL;
+	chunk->index_capacity = 0;
+	chunk->const_index = NULL;
 
 	init_val_arr(&chunk->constants);
 }
 
 void free_chunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
+	// Chunks loaded from a cache borrow their code and lines
+	// from the mapped file, and have no capacity to free.
+	if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	if (chunk->line_capacity > 0) FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
 	free_val_arr(&chunk->constants);
+	free_const_index(chunk);
 
 	init_chunk(chunk);
 }
@@ -48,6 +53,15 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
 	line_start->line = line;
 }
 
+// Drops the code from `count` on, for the compiler to rewrite.
+void truncate_chunk(Chunk* chunk, int count) {
+	chunk->count = count;
+
+	while (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].offset >= count) {
+		chunk->line_count--;
+	}
+}
+
 void write_const(Chunk* chunk, Value value, int line) {
 	int index = add_const(chunk, value);
 	if (index < 256) {
@@ -62,14 +76,214 @@ void write_const(Chunk* chunk, Value value, int line) {
 	}
 }
 
+static uint32_t const_hash(uint64_t bits) {
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdu;
+	bits ^= bits >> 33;
+
+	return (uint32_t)bits;
+}
+
+static void grow_const_index(Chunk* chunk) {
+	int capacity = GROW_CAPACITY(chunk->index_capacity) * 2;
+	int* index = ALLOCATE(int, capacity);
+
+	for (int i = 0; i < capacity; i++) index[i] = -1;
+
+	for (int i = 0; i < chunk->constants.count; i++) {
+		uint32_t slot = const_hash(value_bits(chunk->constants.values[i])) & (capacity - 1);
+
+		while (index[slot] != -1) slot = (slot + 1) & (capacity - 1);
+
+		index[slot] = i;
+	}
+
+	free_const_index(chunk);
+
+	chunk->const_index = index;
+	chunk->index_capacity = capacity;
+}
+
 int add_const(Chunk* chunk, Value value) {
+	uint64_t bits = value_bits(value);
+	uint32_t mask = chunk->index_capacity - 1;
+	uint32_t slot = const_hash(bits) & mask;
+
+	if (chunk->index_capacity > 0) {
+		for (; chunk->const_index[slot] != -1; slot = (slot + 1) & mask) {
+			int existing = chunk->const_index[slot];
+
+			if (value_bits(chunk->constants.values[existing]) == bits) return existing;
+		}
+	}
+
 	push(value);
 	write_val_arr(&chunk->constants, value);
+
+	// Kept at most half full.
+	if (chunk->constants.count * 2 > chunk->index_capacity) {
+		grow_const_index(chunk);
+	}
+	else {
+		chunk->const_index[slot] = chunk->constants.count - 1;
+	}
 	pop();
 
 	return chunk->constants.count - 1;
 }
 
+void free_const_index(Chunk* chunk) {
+	FREE_ARRAY(int, chunk->const_index, chunk->index_capacity);
+	chunk->const_index = NULL;
+	chunk->index_capacity = 0;
+}
+
+// The size in bytes of the instruction at `offset`, any OP_WIDE prefix included.
+int instruct_length(Chunk* chunk, int offset) {
+	uint8_t instruct = chunk->code[offset];
+	int prefix = 0;
+	int width = 1;
+
+	if (instruct == OP_WIDE) {
+		instruct = chunk->code[offset + 1];
+		prefix = 1;
+		width = 3;
+	}
+
+	switch (instruct) {
+		case OP_CONSTANT_LONG:
+			return 4;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+			return prefix + 1 + (prefix ? 3 : 2);
+		case OP_SWITCH_RANGE:
+			return 7 + 2 * ((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+		case OP_SWITCH_HASH:
+			return 5 + 4 * ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+		case OP_INVOKE:
+		case OP_INVOKE_SUPER:
+			return prefix + 2 + width;
+		case OP_ADD_RR:
+		case OP_ADD_RK:
+		case OP_SUB_RR:
+		case OP_SUB_RK:
+		case OP_MUL_RR:
+		case OP_MUL_RK:
+		case OP_DIV_RR:
+		case OP_DIV_RK:
+		case OP_LESS_RR:
+		case OP_LESS_RK:
+		case OP_GREATER_RR:
+		case OP_GREATER_RK:
+		case OP_EQU_RR:
+		case OP_EQU_RK:
+		case OP_MOVE:
+		case OP_LOADK:
+			return 3;
+		case OP_CLOSURE: {
+			const uint8_t* operand = &chunk->code[offset + prefix + 1];
+			int constant = width == 1 ? operand[0] : operand[0] | (operand[1] << 8) | (operand[2] << 16);
+			ObjFunc* function = AS_FUNC(chunk->constants.values[constant]);
+
+			return prefix + 1 + width + function->upval_count * (1 + width);
+		}
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEF_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVAL:
+		case OP_SET_UPVAL:
+		case OP_GET_FLAT:
+		case OP_GET_PROP:
+		case OP_SET_PROP:
+		case OP_GET_SUPER:
+		case OP_CALL:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_STORE:
+			return prefix + 1 + width;
+		default:
+			return 1;
+	}
+}
+
+// How much the instruction at `offset` changes the height of the stack by.
+int stack_effect(Chunk* chunk, int offset) {
+	uint8_t* ip = &chunk->code[offset];
+	bool wide = ip[0] == OP_WIDE;
+
+	switch (ip[wide]) {
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_UPVAL:
+		case OP_GET_FLAT:
+		case OP_DUP:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_ADD_RR:
+		case OP_ADD_RK:
+		case OP_SUB_RR:
+		case OP_SUB_RK:
+		case OP_MUL_RR:
+		case OP_MUL_RK:
+		case OP_DIV_RR:
+		case OP_DIV_RK:
+		case OP_LESS_RR:
+		case OP_LESS_RK:
+		case OP_GREATER_RR:
+		case OP_GREATER_RK:
+		case OP_EQU_RR:
+		case OP_EQU_RK:
+			return 1;
+		case OP_POP:
+		case OP_DEF_GLOBAL:
+		case OP_SET_PROP:
+		case OP_GET_SUPER:
+		case OP_EQU:
+		case OP_LESS:
+		case OP_GREATER:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_ADD_NUM:
+		case OP_SUB_NUM:
+		case OP_MUL_NUM:
+		case OP_DIV_NUM:
+		case OP_LESS_NUM:
+		case OP_GREATER_NUM:
+		case OP_EQU_NUM:
+		case OP_PRINT:
+		case OP_MEMO:
+		case OP_CLOSE_UPVAL:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_STORE:
+			return -1;
+		case OP_CALL:
+			return -ip[1];
+		case OP_CALL_0:
+		case OP_CALL_1:
+		case OP_CALL_2:
+		case OP_CALL_3:
+			return -(ip[0] - OP_CALL_0);
+		// The argument count follows the method name.
+		case OP_INVOKE:
+			return -ip[wide ? 5 : 2];
+		case OP_INVOKE_SUPER:
+			return -ip[wide ? 5 : 2] - 1;
+		default:
+			return 0;
+	}
+}
+
 int get_line(Chunk* chunk, int instruct) {
 	int start = 0;
 	int end = chunk->line_count - 1;
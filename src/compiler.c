@@ -1,12 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include "include/compiler.h"
 #include "include/common.h"
 #include "include/scanner.h"
 #include "include/memory.h"
+#include "include/optimize.h"
 
-#define MAX_CASES 256
 
 #ifdef DEBUG_PRINT_CODE
 #include "include/debug.h"
@@ -45,13 +46,26 @@ typedef struct {
   Token name;
   int depth;
   bool is_captured;
+  // Set once the local may change after a closure captures it.
+  bool is_assigned;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool is_local;
 } Upval;
 
+/*
+  Where an OP_CLOSURE captures `local`. Captures start out boxed,
+  and go flat once the local's scope ends without it changing.
+*/
+typedef struct {
+  int local;
+  int offset;
+  ObjFunc* function;
+  int upval;
+} Capture;
+
 typedef enum {
   TYPE_FUNC,
   TYPE_INIT,
@@ -59,14 +73,48 @@ typedef enum {
   TYPE_SCRIPT,
 } FuncType;
 
+/*
+  What the compiler knows about the value pushed by the
+  instruction at [start, end), so later instructions that
+  consume it can be folded away. Only straight-line code
+  counts: nothing may jump past `barrier` into it.
+*/
+typedef enum {
+  KNOWN_CONST,
+  KNOWN_NUM,
+  KNOWN_BOOL,
+} KnownKind;
+
+typedef struct {
+  KnownKind kind;
+  int start;
+  int end;
+  Value value;
+} Known;
+
+#define KNOWN_MAX 4
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunc* function;
   FuncType type;
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int local_count;
-  Upval upvals[UINT8_COUNT];
+  int local_capacity;
+  Upval* upvals;
+  int upval_capacity;
+  Capture* captures;
+  int capture_count;
+  int capture_capacity;
   int scope_depth;
+  // Set once a jump has been too far for 16 bits, after which
+  // the function is compiled again with 24-bit jumps.
+  bool jump_overflow;
+  bool wide_jumps;
+  Known known[KNOWN_MAX];
+  int known_count;
+  // The furthest any jump lands so far.
+  int barrier;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -74,9 +122,31 @@ typedef struct ClassCompiler {
   bool has_superclass;
 } ClassCompiler;
 
+/*
+  Everything needed to compile a function body after the
+  compilers around it are gone: where the parameter list
+  starts, what kind of function it is, and the names of
+  its upvalues, in the order the closure captures them.
+*/
+typedef struct LazyBody {
+  const char* start;
+  int line;
+  FuncType type;
+  bool in_class;
+  bool has_superclass;
+  int name_capacity;
+  Token* names;
+} LazyBody;
+
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* current_class = NULL;
+// Whether function bodies are left until their first call.
+static bool lazy_mode = false;
+// How hard finished chunks are optimized, see optimize.h.
+static int opt_level = 0;
+// Whether finished chunks are rewritten into register forms.
+static bool reg_mode = false;
 
 static Chunk* current_chunk() {
   return &current->function->chunk;
@@ -151,6 +221,23 @@ static void rel_bytes(uint8_t byte1, uint8_t byte2) {
   rel_byte(byte2);
 }
 
+static void rel_wide(int operand) {
+  rel_byte(operand & 0xff);
+  rel_byte((operand >> 8) & 0xff);
+  rel_byte((operand >> 16) & 0xff);
+}
+
+// Emits an instruction with one index operand, behind OP_WIDE if it needs more than a byte.
+static void rel_op(uint8_t instruct, int operand) {
+  if (operand <= UINT8_MAX) {
+    rel_bytes(instruct, (uint8_t)operand);
+    return;
+  }
+
+  rel_bytes(OP_WIDE, instruct);
+  rel_wide(operand);
+}
+
 static void rel_return() {
   if (current->type == TYPE_INIT) {
     rel_bytes(OP_GET_LOCAL, 0);
@@ -161,48 +248,263 @@ static void rel_return() {
   rel_byte(OP_RETURN);
 }
 
-static uint8_t make_const(Value value) {
+static int make_const(Value value) {
   int constant = add_const(current_chunk(), value);
 
-  if (constant > UINT8_MAX) {
+  if (constant > WIDE_MAX) {
     error("Too many consts in one chunk.");
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+static void note_known(KnownKind kind, int start, Value value) {
+  if (current->known_count == KNOWN_MAX) {
+    memmove(current->known, current->known + 1, sizeof(Known) * (KNOWN_MAX - 1));
+    current->known_count--;
+  }
+
+  Known* known = &current->known[current->known_count++];
+  known->kind = kind;
+  known->start = start;
+  known->end = current_chunk()->count;
+  known->value = value;
+}
+
+// The instruction ending at `end`, if what it pushes is known.
+static Known* known_ending(int end) {
+  for (int i = current->known_count - 1; i >= 0; i--) {
+    if (current->known[i].end == end) return &current->known[i];
+  }
+  return NULL;
+}
+
+static void cut_code(int offset) {
+  truncate_chunk(current_chunk(), offset);
+
+  while (current->known_count > 0 && current->known[current->known_count - 1].end > offset) {
+    current->known_count--;
+  }
 }
 
 static void rel_const(Value value) {
-  rel_bytes(OP_CONSTANT, make_const(value));
+  int start = current_chunk()->count;
+
+  // A folded bool or nil loads the way its literal does, and never takes a constant.
+  if (IS_BOOL(value) || IS_NIL(value)) {
+    rel_byte(IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    note_known(KNOWN_CONST, start, value);
+    return;
+  }
+
+  int constant = make_const(value);
+
+  if (constant <= UINT8_MAX) {
+    rel_bytes(OP_CONSTANT, (uint8_t)constant);
+  }
+  else {
+    rel_byte(OP_CONSTANT_LONG);
+    rel_wide(constant);
+  }
+  note_known(KNOWN_CONST, start, value);
+}
+
+static bool fold_binary(uint8_t instruct, Value a, Value b, Value* result) {
+  if (instruct == OP_EQU) {
+    *result = BOOL_VAL(value_equ(a, b));
+    return true;
+  }
+
+  if (instruct == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    int length = left->length + right->length;
+    char* chars = ALLOCATE(char, length + 1);
+
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+
+    *result = OBJ_VAL(take_string(chars, length));
+    return true;
+  }
+
+  // Anything else is left for the VM to report at runtime.
+  if (!IS_NUM(a) || !IS_NUM(b)) return false;
+
+  double x = AS_NUM(a);
+  double y = AS_NUM(b);
+
+  switch (instruct) {
+    case OP_ADD:     *result = NUM_VAL(x + y); return true;
+    case OP_SUB:     *result = NUM_VAL(x - y); return true;
+    case OP_MUL:     *result = NUM_VAL(x * y); return true;
+    case OP_DIV:     *result = NUM_VAL(x / y); return true;
+    case OP_LESS:    *result = BOOL_VAL(x < y); return true;
+    case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+    default:         return false;
+  }
+}
+
+// Whether `x op value` is just x for any number x.
+static bool is_identity(uint8_t instruct, Value value) {
+  if (!IS_NUM(value)) return false;
+
+  double y = AS_NUM(value);
+
+  switch (instruct) {
+    // Adding 0 turns -0 into 0, adding -0 changes nothing.
+    case OP_ADD: return y == 0 && signbit(y);
+    case OP_SUB: return y == 0 && !signbit(y);
+    case OP_MUL:
+    case OP_DIV: return y == 1;
+    default:     return false;
+  }
+}
+
+static void rel_binary(uint8_t instruct) {
+  int end = current_chunk()->count;
+  Known* b = known_ending(end);
+  Known* a = b != NULL ? known_ending(b->start) : NULL;
+
+  if (a != NULL && a->kind == KNOWN_CONST && b->kind == KNOWN_CONST && current->barrier <= a->start) {
+    Value result;
+
+    if (fold_binary(instruct, a->value, b->value, &result)) {
+      cut_code(a->start);
+      rel_const(result);
+      return;
+    }
+  }
+
+  // The left side has already been checked to be a number, and
+  // nothing can jump in between to push something else.
+  if (a != NULL && a->kind == KNOWN_NUM && b->kind == KNOWN_CONST
+      && current->barrier < b->start && is_identity(instruct, b->value)) {
+    cut_code(b->start);
+    return;
+  }
+
+  bool numbers = a != NULL && (a->kind == KNOWN_NUM || (a->kind == KNOWN_CONST && IS_NUM(a->value)))
+    && (b->kind == KNOWN_NUM || (b->kind == KNOWN_CONST && IS_NUM(b->value)));
+
+  rel_byte(instruct);
+
+  switch (instruct) {
+    case OP_EQU:
+    case OP_LESS:
+    case OP_GREATER:
+      note_known(KNOWN_BOOL, end, NIL_VAL);
+      break;
+    case OP_ADD:
+      if (numbers) note_known(KNOWN_NUM, end, NIL_VAL);
+      break;
+    default:
+      note_known(KNOWN_NUM, end, NIL_VAL);
+      break;
+  }
+}
+
+static void rel_unary(uint8_t instruct) {
+  Chunk* chunk = current_chunk();
+  int end = chunk->count;
+  Known* x = known_ending(end);
+
+  if (x != NULL && x->kind == KNOWN_CONST && current->barrier <= x->start) {
+    Value value = x->value;
+
+    if (instruct == OP_NOT) {
+      cut_code(x->start);
+      rel_const(BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value))));
+      return;
+    }
+
+    if (IS_NUM(value)) {
+      cut_code(x->start);
+      rel_const(NUM_VAL(-AS_NUM(value)));
+      return;
+    }
+  }
+
+  KnownKind kind = instruct == OP_NOT ? KNOWN_BOOL : KNOWN_NUM;
+
+  // `--x` and `!!x` cancel out, when x is already a number or a bool.
+  if (x != NULL && x->kind == kind && chunk->code[x->start] == instruct && current->barrier < x->start) {
+    Known* inner = known_ending(x->start);
+
+    if (inner != NULL && inner->kind == kind) {
+      cut_code(x->start);
+      return;
+    }
+  }
+
+  rel_byte(instruct);
+  note_known(kind, end, NIL_VAL);
 }
 
 static void patch_jump(int offset) {
-  int jump = current_chunk()->count - offset - 2;
+  Chunk* chunk = current_chunk();
+
+  current->barrier = chunk->count;
+
+  if (current->wide_jumps) {
+    int jump = chunk->count - offset - 3;
+
+    if (jump > WIDE_MAX) {
+      error("Too much to jump over.");
+    }
+
+    chunk->code[offset] = jump & 0xff;
+    chunk->code[offset + 1] = (jump >> 8) & 0xff;
+    chunk->code[offset + 2] = (jump >> 16) & 0xff;
+
+    return;
+  }
 
+  int jump = chunk->count - offset - 2;
+
+  // The rest of this attempt is thrown away, so keep going
+  // only to find where the function ends.
   if (jump > UINT16_MAX) {
-    error("Too much to jump over.");
+    current->jump_overflow = true;
   }
 
-  current_chunk()->code[offset] = (jump >> 8) & 0xff;
-  current_chunk()->code[offset + 1] = jump & 0xff;
+  chunk->code[offset] = (jump >> 8) & 0xff;
+  chunk->code[offset + 1] = jump & 0xff;
 }
 
-static void init_compiler(Compiler* compiler, FuncType type) {
+static void init_compiler(Compiler* compiler, FuncType type, ObjFunc* function) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->local_count = 0;
+  compiler->local_capacity = 0;
+  compiler->upvals = NULL;
+  compiler->upval_capacity = 0;
+  compiler->captures = NULL;
+  compiler->capture_count = 0;
+  compiler->capture_capacity = 0;
   compiler->scope_depth = 0;
-  compiler->function = new_func();
+  compiler->jump_overflow = false;
+  compiler->wide_jumps = false;
+  compiler->known_count = 0;
+  compiler->barrier = 0;
+  compiler->function = function != NULL ? function : new_func();
 
   current = compiler;
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name = copy_string(parser.prev.start, parser.prev.length);
   }
 
+  current->local_capacity = GROW_CAPACITY(0);
+  current->locals = GROW_ARRAY(Local, NULL, 0, current->local_capacity);
+
   Local* local = &current->locals[current->local_count++];
   local->depth = 0;
   local->is_captured = false;
+  local->is_assigned = false;
 
   if (type != TYPE_FUNC) {
     local->name.start = "this";
@@ -214,14 +516,90 @@ static void init_compiler(Compiler* compiler, FuncType type) {
   }
 }
 
+static void free_compiler(Compiler* compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->local_capacity);
+  FREE_ARRAY(Upval, compiler->upvals, compiler->upval_capacity);
+  FREE_ARRAY(Capture, compiler->captures, compiler->capture_capacity);
+}
+
+// Turns the reads of upvalue `index` in `function`, and in the closures it
+// passes that upvalue on to, into reads of a value captured flat.
+static void flatten_upval(ObjFunc* function, int index) {
+  Chunk* chunk = &function->chunk;
+
+  for (int offset = 0; offset < chunk->count; offset += instruct_length(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    int wide = code[0] == OP_WIDE;
+    int width = wide ? 3 : 1;
+
+    if (code[wide] != OP_GET_UPVAL && code[wide] != OP_CLOSURE) continue;
+
+    int operand = wide ? code[2] | (code[3] << 8) | (code[4] << 16) : code[1];
+
+    if (code[wide] == OP_GET_UPVAL && operand == index) {
+      code[wide] = OP_GET_FLAT;
+    }
+    else if (code[wide] == OP_CLOSURE) {
+      ObjFunc* inner = AS_FUNC(chunk->constants.values[operand]);
+      uint8_t* capture = code + wide + 1 + width;
+
+      for (int i = 0; i < inner->upval_count; i++, capture += 1 + width) {
+        int from = wide ? capture[1] | (capture[2] << 8) | (capture[3] << 16) : capture[1];
+
+        if (capture[0] == CAPTURE_UPVAL && from == index) flatten_upval(inner, i);
+      }
+    }
+  }
+}
+
+// Settles how `local` is captured now that it can't change any more,
+// returning whether it still needs closing as a boxed upvalue.
+static bool settle_captures(int local) {
+  bool flat = !current->locals[local].is_assigned;
+
+  for (int i = 0; i < current->capture_count;) {
+    Capture* capture = &current->captures[i];
+
+    if (capture->local != local) {
+      i++;
+      continue;
+    }
+
+    if (flat) {
+      current_chunk()->code[capture->offset] = CAPTURE_FLAT;
+      flatten_upval(capture->function, capture->upval);
+    }
+
+    *capture = current->captures[--current->capture_count];
+  }
+
+  return current->locals[local].is_captured && !flat;
+}
+
 static ObjFunc* end_compiler() {
   rel_return();
 
+  for (int i = 0; i < current->local_count; i++) settle_captures(i);
+
   ObjFunc* function = current->function;
 
+  free_const_index(&function->chunk);
+
+  if (!parser.has_error) {
+    optimize_chunk(&function->chunk, opt_level);
+    if (reg_mode) to_registers(&function->chunk);
+    find_trivial(function);
+    specialize(function);
+    find_max_stack(function);
+    find_live(function);
+  }
+
   #ifdef DEBUG_PRINT_CODE
     if (!parser.has_error) {
-      disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+      ObjString* name = function->name;
+
+      if (name != NULL) disassemble_chunk(current_chunk(), name->chars, name->length);
+      else disassemble_chunk(current_chunk(), "<script>", 8);
     }
   #endif
 
@@ -237,7 +615,7 @@ static void end_scope() {
   current->scope_depth--;
 
   while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
-    if (current->locals[current->local_count - 1].is_captured) {
+    if (settle_captures(current->local_count - 1)) {
       rel_byte(OP_CLOSE_UPVAL);
     }
     else {
@@ -253,7 +631,7 @@ static void declaration();
 static ParseRule* get_rule(TokenType type);
 static void parse_prec(Prec prec);
 
-static uint8_t ident_const(Token* name) {
+static int ident_const(Token* name) {
   return make_const(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
@@ -277,7 +655,7 @@ static int resolve_local(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int add_upval(Compiler* compiler, uint8_t index, bool is_local) {
+static int add_upval(Compiler* compiler, int index, bool is_local) {
   int upval_count = compiler->function->upval_count;
 
   for (int i = 0; i < upval_count; i++) {
@@ -288,48 +666,93 @@ static int add_upval(Compiler* compiler, uint8_t index, bool is_local) {
     }
   }
 
-  if (upval_count == UINT8_COUNT) {
+  if (upval_count > WIDE_MAX) {
     error("Too many closure variables in function.");
 
     return 0;
   }
 
+  if (upval_count == compiler->upval_capacity) {
+    int old_capacity = compiler->upval_capacity;
+
+    compiler->upval_capacity = GROW_CAPACITY(old_capacity);
+    compiler->upvals = GROW_ARRAY(Upval, compiler->upvals, old_capacity, compiler->upval_capacity);
+  }
+
   compiler->upvals[upval_count].is_local = is_local;
   compiler->upvals[upval_count].index = index;
 
   return compiler->function->upval_count++;
 }
 
+static int resolve_lazy(Compiler* compiler, Token* name) {
+  LazyBody* lazy = compiler->function->lazy;
+
+  if (lazy == NULL) return -1;
+
+  for (int i = 0; i < compiler->function->upval_count; i++) {
+    if (ident_equ(name, &lazy->names[i])) return i;
+  }
+  return -1;
+}
+
+// The variable behind an upvalue is being assigned, so it has to stay boxed.
+static void assign_upval(Compiler* compiler, int index) {
+  // Lazy bodies only capture boxed variables.
+  while (compiler->enclosing != NULL) {
+    Upval* upval = &compiler->upvals[index];
+
+    compiler = compiler->enclosing;
+
+    if (upval->is_local) {
+      compiler->locals[upval->index].is_assigned = true;
+      return;
+    }
+
+    index = upval->index;
+  }
+}
+
 static int resolve_upval(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  // A lazy body is compiled on its own, with only the names
+  // it captured at its definition to go by.
+  if (compiler->enclosing == NULL) return resolve_lazy(compiler, name);
 
   int local = resolve_local(compiler->enclosing, name);
 
   if (local != -1) {
     compiler->enclosing->locals[local].is_captured = true;
 
-    return add_upval(compiler, (uint8_t)local, true);
+    return add_upval(compiler, local, true);
   }
 
   int upval = resolve_upval(compiler->enclosing, name);
 
   if (upval != -1) {
-    return add_upval(compiler, (uint8_t)upval, false);
+    return add_upval(compiler, upval, false);
   }
   return -1;
 }
 
 static void add_local(Token name) {
-  if (current->local_count == UINT8_COUNT) {
+  if (current->local_count > WIDE_MAX) {
     error("Too many local variables in function.");
 
     return;
   }
 
+  if (current->local_count == current->local_capacity) {
+    int old_capacity = current->local_capacity;
+
+    current->local_capacity = GROW_CAPACITY(old_capacity);
+    current->locals = GROW_ARRAY(Local, current->locals, old_capacity, current->local_capacity);
+  }
+
   Local* local = &current->locals[current->local_count++];
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
+  local->is_assigned = false;
 }
 
 static void declare_var() {
@@ -351,7 +774,7 @@ static void declare_var() {
   add_local(*name);
 }
 
-static uint8_t parse_var(const char* err_message) {
+static int parse_var(const char* err_message) {
   consume(T_IDENT, err_message);
 
   declare_var();
@@ -366,12 +789,12 @@ static void mark_init() {
   current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void def_var(uint8_t global) {
+static void def_var(int global) {
   if (current->scope_depth > 0) {
     mark_init();
     return;
   }
-  rel_bytes(OP_DEF_GLOBAL, global);
+  rel_op(OP_DEF_GLOBAL, global);
 }
 
 static uint8_t argument_list() {
@@ -394,6 +817,13 @@ static uint8_t argument_list() {
 }
 
 static int rel_jump(uint8_t instruct) {
+  if (current->wide_jumps) {
+    rel_bytes(OP_WIDE, instruct);
+    rel_wide(0xffffff);
+
+    return current_chunk()->count - 3;
+  }
+
   rel_byte(instruct);
   rel_byte(0xff);
   rel_byte(0xff);
@@ -416,50 +846,54 @@ static void bin(bool can_assign) {
   parse_prec((Prec)(rule->prec + 1));
 
   switch (op_type) {
-    case T_BANG_EQU:    rel_bytes(OP_EQU, OP_NOT); break;
-    case T_EQU_EQU:     rel_byte(OP_EQU); break;
-    case T_GREATER:     rel_byte(OP_GREATER); break;
-    case T_GREATER_EQU: rel_bytes(OP_LESS, OP_NOT); break;
-    case T_LESS:        rel_byte(OP_LESS); break;
-    case T_LESS_EQU:    rel_bytes(OP_GREATER, OP_NOT); break;
-    case T_PLUS:        rel_byte(OP_ADD); break;
-    case T_MINUS:       rel_bytes(OP_NEGATE, OP_ADD); break;
-    case T_STAR:        rel_byte(OP_MUL); break;
-    case T_SLASH:       rel_byte(OP_DIV); break;
+    case T_BANG_EQU:    rel_binary(OP_EQU); rel_unary(OP_NOT); break;
+    case T_EQU_EQU:     rel_binary(OP_EQU); break;
+    case T_GREATER:     rel_binary(OP_GREATER); break;
+    case T_GREATER_EQU: rel_binary(OP_LESS); rel_unary(OP_NOT); break;
+    case T_LESS:        rel_binary(OP_LESS); break;
+    case T_LESS_EQU:    rel_binary(OP_GREATER); rel_unary(OP_NOT); break;
+    case T_PLUS:        rel_binary(OP_ADD); break;
+    case T_MINUS:       rel_unary(OP_NEGATE); rel_binary(OP_ADD); break;
+    case T_STAR:        rel_binary(OP_MUL); break;
+    case T_SLASH:       rel_binary(OP_DIV); break;
     default: return;
   }
 }
 
 static void call(bool can_assign) {
   uint8_t arg_count = argument_list();
-  rel_bytes(OP_CALL, arg_count);
+
+  if (arg_count <= 3) rel_byte(OP_CALL_0 + arg_count);
+  else rel_bytes(OP_CALL, arg_count);
 }
 
 static void colon(bool can_assign) {
   consume(T_IDENT, "Expected property name after `:`.");
 
-  uint8_t name = ident_const(&parser.prev);
+  int name = ident_const(&parser.prev);
 
   if (can_assign && match(T_LARROW)) {
     expr();
-    rel_bytes(OP_SET_PROP, name);
+    rel_op(OP_SET_PROP, name);
   }
   else if (match(T_LPAREN)) {
     uint8_t arg_count = argument_list();
 
-    rel_bytes(OP_INVOKE, name);
+    rel_op(OP_INVOKE, name);
     rel_byte(arg_count);
   }
   else {
-    rel_bytes(OP_GET_PROP, name);
+    rel_op(OP_GET_PROP, name);
   }
 }
 
 static void literal(bool can_assign) {
+  int start = current_chunk()->count;
+
   switch (parser.prev.type) {
-    case T_FALSE: rel_byte(OP_FALSE); break;
-    case T_NIL: rel_byte(OP_NIL); break;
-    case T_TRUE: rel_byte(OP_TRUE); break;
+    case T_FALSE: rel_byte(OP_FALSE); note_known(KNOWN_CONST, start, BOOL_VAL(false)); break;
+    case T_NIL: rel_byte(OP_NIL); note_known(KNOWN_CONST, start, NIL_VAL); break;
+    case T_TRUE: rel_byte(OP_TRUE); note_known(KNOWN_CONST, start, BOOL_VAL(true)); break;
     default: return;
   }
 }
@@ -510,10 +944,13 @@ static void named_variable(Token name, bool can_assign) {
 
   if (can_assign && match(T_LARROW)) {
     expr();
-    rel_bytes(set_op, (uint8_t)arg);
+    rel_op(set_op, arg);
+
+    if (set_op == OP_SET_LOCAL) current->locals[arg].is_assigned = true;
+    if (set_op == OP_SET_UPVAL) assign_upval(current, arg);
   }
   else {
-    rel_bytes(get_op, (uint8_t)arg);
+    rel_op(get_op, arg);
   }
 }
 
@@ -541,7 +978,7 @@ static void super_(bool can_assign) {
   consume(T_COLON, "Expected `:` after `super`.");
   consume(T_IDENT, "Expected a superclass method name.");
 
-  uint8_t name = ident_const(&parser.prev);
+  int name = ident_const(&parser.prev);
 
   named_variable(synth_token("this"), false);
 
@@ -550,12 +987,12 @@ static void super_(bool can_assign) {
 
     named_variable(synth_token("super"), false);
 
-    rel_bytes(OP_INVOKE_SUPER, name);
+    rel_op(OP_INVOKE_SUPER, name);
     rel_byte(arg_count);
   }
   else {
     named_variable(synth_token("super"), false);
-    rel_bytes(OP_GET_SUPER, name);
+    rel_op(OP_GET_SUPER, name);
   }
 }
 
@@ -573,8 +1010,8 @@ static void unary(bool can_assign) {
   parse_prec(PREC_UNARY);
 
   switch (op_type) {
-    case T_BANG: rel_byte(OP_NOT); break;
-    case T_MINUS: rel_byte(OP_NEGATE); break;
+    case T_BANG: rel_unary(OP_NOT); break;
+    case T_MINUS: rel_unary(OP_NEGATE); break;
     default: return;
   }
 }
@@ -611,6 +1048,7 @@ ParseRule rules[] = {
   [T_NUM]           = {num,      NULL,   PREC_NONE},
   [T_CASE]          = {NULL,     NULL,   PREC_NONE},
   [T_MATCH]         = {NULL,     NULL,   PREC_NONE},
+  [T_MEMO]          = {NULL,     NULL,   PREC_NONE},
   [T_AND]           = {NULL,     and_,   PREC_AND},
   [T_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [T_ELSE]          = {NULL,     NULL,   PREC_NONE},
@@ -671,10 +1109,7 @@ static void block() {
   consume(T_END, "Expected `end` after `do`.");
 }
 
-static void function(FuncType type) {
-  Compiler compiler;
-  init_compiler(&compiler, type);
-
+static void function_params() {
   begin_scope();
 
   consume(T_LPAREN, "Expected `(` after function name.");
@@ -686,28 +1121,201 @@ static void function(FuncType type) {
         err_at_curr("Cannot have more than 255 parameters.");
       }
 
-      uint8_t constant = parse_var("Expected variable name.");
+      int constant = parse_var("Expected variable name.");
       def_var(constant);
     }
     while (match(T_COMMA));
   }
   consume(T_RPAREN, "Expected `)` after parameters.");
   consume(T_DO, "Expected `do` before the function body.");
+}
 
+static void function_block() {
+  function_params();
   block();
+}
 
-  ObjFunc* function = end_compiler();
-  rel_bytes(OP_CLOSURE, make_const(OBJ_VAL(function)));
+/*
+  Runs `body` to compile the current function. If one of its
+  jumps turned out too long for 16 bits, everything is thrown
+  away and compiled again from the same spot with 24-bit
+  jumps, so functions that fit never pay for wide jumps.
+*/
+static void compile_jumps(void (*body)()) {
+  Scanner scanner_start = scanner;
+  Parser parser_start = parser;
+
+  for (;;) {
+    body();
+
+    if (!current->jump_overflow || current->wide_jumps || parser.has_error) return;
+
+    ObjFunc* function = current->function;
+
+    scanner = scanner_start;
+    parser = parser_start;
+
+    free_chunk(&function->chunk);
+    function->arity = 0;
+
+    // A lazy body keeps the upvalues from its definition.
+    if (function->lazy == NULL) function->upval_count = 0;
+
+    current->local_count = 1;
+    current->scope_depth = 0;
+    current->jump_overflow = false;
+    current->wide_jumps = true;
+    current->known_count = 0;
+    current->barrier = 0;
+    current->capture_count = 0;
+  }
+}
+
+static void capture_name(Token name) {
+  if (resolve_local(current, &name) != -1) return;
+
+  int upval = resolve_upval(current, &name);
+
+  if (upval == -1) return;
+
+  // There's no telling yet whether the body assigns it.
+  assign_upval(current, upval);
+
+  if (upval < current->function->upval_count - 1) return;
+
+  LazyBody* lazy = current->function->lazy;
+
+  if (upval >= lazy->name_capacity) {
+    int old_capacity = lazy->name_capacity;
+
+    lazy->name_capacity = GROW_CAPACITY(old_capacity);
+    lazy->names = GROW_ARRAY(Token, lazy->names, old_capacity, lazy->name_capacity);
+  }
+  lazy->names[upval] = name;
+}
+
+/*
+  Skips to the `end` matching the body's `do`, capturing any
+  name the body might use from the functions around it. This
+  over-approximates: a name the body declares itself, or
+  never reads, may still be captured, which is harmless.
+*/
+static ObjFunc* skip_body(FuncType type) {
+  LazyBody* lazy = ALLOCATE(LazyBody, 1);
+
+  lazy->start = parser.current.start;
+  lazy->line = parser.current.line;
+  lazy->type = type;
+  lazy->in_class = current_class != NULL;
+  lazy->has_superclass = current_class != NULL && current_class->has_superclass;
+  lazy->name_capacity = 0;
+  lazy->names = NULL;
+  current->function->lazy = lazy;
+
+  function_params();
+
+  int depth = 1;
+
+  while (!check(T_EOS)) {
+    if (check(T_DO)) {
+      depth++;
+    }
+    else if (check(T_END) && --depth == 0) {
+      break;
+    }
+    else if (parser.prev.type != T_COLON) {
+      if (check(T_IDENT) || check(T_THIS)) capture_name(parser.current);
+
+      if (check(T_SUPER)) {
+        capture_name(synth_token("this"));
+        capture_name(synth_token("super"));
+      }
+    }
+    adv();
+  }
+  consume(T_END, "Expected `end` after `do`.");
+
+  ObjFunc* function = current->function;
+
+  current = current->enclosing;
+
+  return function;
+}
+
+static void function(FuncType type) {
+  Compiler compiler;
+  init_compiler(&compiler, type, NULL);
+
+  ObjFunc* function;
+
+  if (lazy_mode) {
+    function = skip_body(type);
+  }
+  else {
+    compile_jumps(function_block);
+    function = end_compiler();
+  }
+
+  // Without upvalues every closure would be the same, so one is made now and shared.
+  if (function->upval_count == 0) {
+    push(OBJ_VAL(function));
+
+    ObjClose* closure = new_close(function);
+
+    push(OBJ_VAL(closure));
+    rel_const(OBJ_VAL(closure));
+    pop();
+    pop();
+
+    free_compiler(&compiler);
+    return;
+  }
+
+  int constant = make_const(OBJ_VAL(function));
+  bool wide = constant > UINT8_MAX;
 
   for (int i = 0; i < function->upval_count; i++) {
-    rel_byte(compiler.upvals[i].is_local ? 1 : 0);
-    rel_byte(compiler.upvals[i].index);
+    if (compiler.upvals[i].index > UINT8_MAX) wide = true;
+  }
+
+  // OP_WIDE widens the constant and every capture index.
+  if (wide) {
+    rel_bytes(OP_WIDE, OP_CLOSURE);
+    rel_wide(constant);
+  }
+  else {
+    rel_bytes(OP_CLOSURE, (uint8_t)constant);
   }
+
+  Capture* capture;
+
+  for (int i = 0; i < function->upval_count; i++) {
+    if (compiler.upvals[i].is_local) {
+      if (current->capture_count == current->capture_capacity) {
+        int old_capacity = current->capture_capacity;
+
+        current->capture_capacity = GROW_CAPACITY(old_capacity);
+        current->captures = GROW_ARRAY(Capture, current->captures, old_capacity, current->capture_capacity);
+      }
+
+      capture = &current->captures[current->capture_count++];
+      capture->local = compiler.upvals[i].index;
+      capture->offset = current_chunk()->count;
+      capture->function = function;
+      capture->upval = i;
+    }
+
+    rel_byte(compiler.upvals[i].is_local ? CAPTURE_LOCAL : CAPTURE_UPVAL);
+
+    if (wide) rel_wide(compiler.upvals[i].index);
+    else rel_byte((uint8_t)compiler.upvals[i].index);
+  }
+  free_compiler(&compiler);
 }
 
 static void method() {
   consume(T_IDENT, "Expected a named method.");
-  uint8_t constant = ident_const(&parser.prev);
+  int constant = ident_const(&parser.prev);
 
   FuncType type = TYPE_METHOD;
 
@@ -715,17 +1323,17 @@ static void method() {
     type = TYPE_INIT;
   }
   function(type);
-  rel_bytes(OP_METHOD, constant);
+  rel_op(OP_METHOD, constant);
 }
 
 static void class_decl() {
   consume(T_IDENT, "Expected a named class.");
   Token class_name = parser.prev;
-  uint8_t name_const = ident_const(&parser.prev);
+  int name_const = ident_const(&parser.prev);
 
   declare_var();
 
-  rel_bytes(OP_CLASS, name_const);
+  rel_op(OP_CLASS, name_const);
   def_var(name_const);
 
   ClassCompiler class_compiler;
@@ -768,17 +1376,58 @@ static void class_decl() {
   current_class = current_class->enclosing;
 }
 
-static void func_decl() {
-  uint8_t global = parse_var("Expected a named function.");
+// A `limit` of -1 declares a plain function, anything else a memo func.
+static void func_decl(int limit) {
+  int global = parse_var("Expected a named function.");
 
   mark_init();
+
+  int first_capture = current->capture_count;
+
   function(TYPE_FUNC);
 
+  // A function that calls itself captures its local before the closure is in it.
+  for (int i = first_capture; i < current->capture_count && current->scope_depth > 0; i++) {
+    if (current->captures[i].local == current->local_count - 1) {
+      current->locals[current->local_count - 1].is_assigned = true;
+    }
+  }
+
+  if (limit >= 0) {
+    rel_const(NUM_VAL(limit));
+    rel_byte(OP_MEMO);
+  }
+
   def_var(global);
 }
 
+/*
+  `memo func` keeps every result by its arguments, and
+  `memo(n) func` only the n most recently used.
+*/
+static void memo_decl() {
+  int limit = 0;
+
+  if (match(T_LPAREN)) {
+    consume(T_NUM, "Expected a size after `memo(`.");
+
+    double size = strtod(parser.prev.start, NULL);
+
+    if (size < 1 || size > INT32_MAX || size != (int)size) {
+      error("A memo size must be a positive whole number.");
+    }
+    else {
+      limit = (int)size;
+    }
+    consume(T_RPAREN, "Expected `)` after the memo size.");
+  }
+  consume(T_FUN, "Expected `func` after `memo`.");
+
+  func_decl(limit);
+}
+
 static void decl_var() {
-  uint8_t global = parse_var("Expected variable name.");
+  int global = parse_var("Expected variable name.");
 
   if (match(T_LARROW)) {
     expr();
@@ -838,15 +1487,207 @@ static void return_statement() {
   }
 }
 
+// A `match` whose labels are all literals jumps straight to its case
+// through a table, instead of comparing against each label in turn.
+typedef struct {
+  int count;
+  int capacity;
+  int* labels;
+  int start;
+  int slot_count;
+  int* slot_case;
+} Switch;
+
+static void add_label(Switch* table, int label) {
+  if (table->count == table->capacity) {
+    int old_capacity = table->capacity;
+
+    table->capacity = GROW_CAPACITY(old_capacity);
+    table->labels = GROW_ARRAY(int, table->labels, old_capacity, table->capacity);
+  }
+
+  table->labels[table->count++] = label;
+}
+
+// Reads ahead through the cases, collecting their labels as constants.
+static bool scan_labels(Switch* table) {
+  Scanner scanner_start = scanner;
+  Token token = parser.current;
+  int depth = 0;
+  bool ok = true;
+
+  for (;; token = scan_token()) {
+    if (token.type == T_EOS || token.type == T_ERR) {
+      ok = false;
+      break;
+    }
+
+    if (token.type == T_DO) {
+      depth++;
+    }
+    else if (token.type == T_END) {
+      if (depth-- == 0) break;
+    }
+    else if (token.type == T_CASE && depth == 0) {
+      Token label = scan_token();
+      bool negate = label.type == T_MINUS;
+      Value value;
+
+      if (negate) label = scan_token();
+
+      if (label.type == T_NUM) {
+        double num = strtod(label.start, NULL);
+
+        value = NUM_VAL(negate ? -num : num);
+      }
+      else if (label.type == T_STRING && !negate) {
+        value = OBJ_VAL(copy_string(label.start + 1, label.length - 2));
+      }
+      else {
+        ok = false;
+        break;
+      }
+
+      int constant = add_const(current_chunk(), value);
+
+      if (constant >= SWITCH_EMPTY || scan_token().type != T_RARROW) {
+        ok = false;
+        break;
+      }
+
+      add_label(table, constant);
+    }
+  }
+
+  scanner = scanner_start;
+
+  return ok && table->count > 0 && table->count <= SWITCH_EMPTY / 4;
+}
+
+static void rel_short(int value) {
+  rel_bytes((value >> 8) & 0xff, value & 0xff);
+}
+
+// Integer labels close together index a table directly, the rest are hashed.
+static void rel_switch(Switch* table) {
+  ValueArray* constants = &current_chunk()->constants;
+  bool dense = true;
+  double lo = 0;
+  double hi = 0;
+
+  for (int i = 0; i < table->count && dense; i++) {
+    Value label = constants->values[table->labels[i]];
+    double num = IS_NUM(label) ? AS_NUM(label) : 0.5;
+
+    dense = num == floor(num) && num >= INT16_MIN && num <= INT16_MAX;
+
+    if (i == 0 || num < lo) lo = num;
+    if (i == 0 || num > hi) hi = num;
+  }
+
+  dense = dense && hi - lo + 1 <= table->count * 2;
+  table->start = current_chunk()->count;
+
+  if (dense) {
+    table->slot_count = (int)(hi - lo) + 1;
+    table->slot_case = ALLOCATE(int, table->slot_count);
+
+    for (int s = 0; s < table->slot_count; s++) table->slot_case[s] = -1;
+
+    for (int i = 0; i < table->count; i++) {
+      int slot = (int)(AS_NUM(constants->values[table->labels[i]]) - lo);
+
+      if (table->slot_case[slot] == -1) table->slot_case[slot] = i;
+    }
+
+    rel_byte(OP_SWITCH_RANGE);
+    rel_short((int)lo);
+    rel_short(table->slot_count);
+    rel_short(0xffff);
+
+    for (int s = 0; s < table->slot_count; s++) rel_short(0xffff);
+
+    return;
+  }
+
+  int capacity = 1;
+
+  while (capacity < table->count * 2) capacity *= 2;
+
+  table->slot_count = capacity;
+  table->slot_case = ALLOCATE(int, capacity);
+
+  for (int s = 0; s < capacity; s++) table->slot_case[s] = -1;
+
+  for (int i = 0; i < table->count; i++) {
+    Value label = constants->values[table->labels[i]];
+    int slot = hash_value(label) & (capacity - 1);
+
+    // A label repeated later never matches, as in the chain of tests.
+    while (table->slot_case[slot] != -1 &&
+        !value_equ(constants->values[table->labels[table->slot_case[slot]]], label)) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+
+    if (table->slot_case[slot] == -1) table->slot_case[slot] = i;
+  }
+
+  rel_byte(OP_SWITCH_HASH);
+  rel_short(capacity);
+  rel_short(0xffff);
+
+  for (int s = 0; s < capacity; s++) {
+    rel_short(table->slot_case[s] == -1 ? SWITCH_EMPTY : table->labels[table->slot_case[s]]);
+    rel_short(0xffff);
+  }
+}
+
+// Points the slots of case `index`, or the default at -1, at the current code.
+static void patch_case(Switch* table, int index) {
+  Chunk* chunk = current_chunk();
+  uint8_t* code = &chunk->code[table->start];
+  bool dense = code[0] == OP_SWITCH_RANGE;
+  int jump = chunk->count - (table->start + instruct_length(chunk, table->start));
+
+  current->barrier = chunk->count;
+
+  if (jump > UINT16_MAX) {
+    current->jump_overflow = true;
+    return;
+  }
+
+  if (index == -1) {
+    code[dense ? 5 : 3] = (jump >> 8) & 0xff;
+    code[dense ? 6 : 4] = jump & 0xff;
+  }
+
+  for (int s = 0; s < table->slot_count; s++) {
+    if (table->slot_case[s] != index) continue;
+
+    int field = dense ? 7 + 2 * s : 7 + 4 * s;
+
+    code[field] = (jump >> 8) & 0xff;
+    code[field + 1] = jump & 0xff;
+  }
+}
+
 static void match_statement() {
   consume(T_LPAREN, "Expected `(` after `match`.");
   expr();
   consume(T_RPAREN, "Expected `)` after value.");
   consume(T_DO, "Expected `do` before cases.");
 
+  Switch table = { 0, 0, NULL, 0, 0, NULL };
+  bool use_table = !current->wide_jumps && scan_labels(&table);
+  bool has_default = false;
+  int case_index = 0;
+
+  if (use_table) rel_switch(&table);
+
   int state = 0;
-  int case_ends[MAX_CASES];
+  int* case_ends = NULL;
   int case_count = 0;
+  int case_capacity = 0;
   int prev_case_skip = -1;
 
   while (!match(T_END) && !check(T_EOS)) {
@@ -858,12 +1699,29 @@ static void match_statement() {
       }
 
       if (state == 1) {
+        if (case_count == case_capacity) {
+          int old_capacity = case_capacity;
+
+          case_capacity = GROW_CAPACITY(old_capacity);
+          case_ends = GROW_ARRAY(int, case_ends, old_capacity, case_capacity);
+        }
+
         case_ends[case_count++] = rel_jump(OP_JUMP);
-        patch_jump(prev_case_skip);
-        rel_byte(OP_POP);
+
+        if (!use_table) {
+          patch_jump(prev_case_skip);
+          rel_byte(OP_POP);
+        }
       }
 
-      if (case_type == T_CASE) {
+      if (case_type == T_CASE && use_table) {
+        state = 1;
+        match(T_MINUS);
+        adv();
+        consume(T_RARROW, "Expected `->` after case value.");
+        patch_case(&table, case_index++);
+      }
+      else if (case_type == T_CASE) {
         state = 1;
         rel_byte(OP_DUP);
         expr();
@@ -879,6 +1737,11 @@ static void match_statement() {
         state = 2;
         consume(T_RARROW, "Expected `->` after the default.");
         prev_case_skip = -1;
+
+        if (use_table) {
+          patch_case(&table, -1);
+          has_default = true;
+        }
       }
     }
     else {
@@ -888,13 +1751,19 @@ static void match_statement() {
       statement();
     }
   }
-  if (state == 1) {
+  if (state == 1 && !use_table) {
     patch_jump(prev_case_skip);
     rel_byte(OP_POP);
   }
   for (int i = 0; i < case_count; i++) {
     patch_jump(case_ends[i]);
   }
+  if (use_table && !has_default) {
+    patch_case(&table, -1);
+  }
+  FREE_ARRAY(int, case_ends, case_capacity);
+  FREE_ARRAY(int, table.labels, table.capacity);
+  FREE_ARRAY(int, table.slot_case, table.slot_count);
   rel_byte(OP_POP);
 }
 
@@ -907,6 +1776,7 @@ static void sync() {
     switch (parser.current.type) {
       case T_CLASS:
       case T_FUN:
+      case T_MEMO:
       case T_VAR:
       case T_FOR:
       case T_IF:
@@ -927,7 +1797,10 @@ static void declaration() {
     class_decl();
   }
   else if (match(T_FUN)) {
-    func_decl();
+    func_decl(-1);
+  }
+  else if (match(T_MEMO)) {
+    memo_decl();
   }
   else if (match(T_VAR)) {
     decl_var();
@@ -962,26 +1835,98 @@ static void statement() {
   }
 }
 
+static void script_block() {
+  while (!match(T_EOS)) {
+    declaration();
+  }
+}
+
 ObjFunc* compile(const char* src) {
   init_scanner(src);
 
   Compiler compiler;
 
-  init_compiler(&compiler, TYPE_SCRIPT);
+  init_compiler(&compiler, TYPE_SCRIPT, NULL);
 
   parser.has_error = false;
   parser.panic = false;
 
   adv();
-
-  while (!match(T_EOS)) {
-    declaration();
-  }
+  compile_jumps(script_block);
 
   ObjFunc* function = end_compiler();
+
+  free_compiler(&compiler);
+
   return parser.has_error ? NULL : function;
 }
 
+/*
+  Like compile, but nested function bodies are only scanned
+  for their end and their captures. The source has to stay
+  around until the last of them has been compiled.
+*/
+ObjFunc* compile_lazy(const char* src) {
+  lazy_mode = true;
+
+  ObjFunc* function = compile(src);
+
+  lazy_mode = false;
+
+  return function;
+}
+
+bool compile_body(ObjFunc* function) {
+  LazyBody* lazy = function->lazy;
+  ClassCompiler class_compiler;
+
+  class_compiler.enclosing = NULL;
+  class_compiler.has_superclass = lazy->has_superclass;
+  current_class = lazy->in_class ? &class_compiler : NULL;
+
+  scanner.start = lazy->start;
+  scanner.current = lazy->start;
+  scanner.line = lazy->line;
+
+  parser.has_error = false;
+  parser.panic = false;
+  lazy_mode = true;
+
+  Compiler compiler;
+
+  init_compiler(&compiler, lazy->type, function);
+  function->arity = 0;
+
+  adv();
+  compile_jumps(function_block);
+  end_compiler();
+  free_compiler(&compiler);
+
+  lazy_mode = false;
+  current_class = NULL;
+  function->lazy = NULL;
+  free_lazy(lazy);
+
+  return !parser.has_error;
+}
+
+void free_lazy(LazyBody* lazy) {
+  FREE_ARRAY(Token, lazy->names, lazy->name_capacity);
+  FREE(LazyBody, lazy);
+}
+
+void set_opt_level(int level) {
+  opt_level = level;
+}
+
+void set_reg_mode(bool enabled) {
+  reg_mode = enabled;
+}
+
+uint32_t compile_options() {
+  return (uint32_t)opt_level | (reg_mode ? COMPILE_REG : 0);
+}
+
 void mark_compiler_root() {
   Compiler* compiler = current;
 
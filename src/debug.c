@@ -3,8 +3,9 @@
 #include "include/object.h"
 #include "include/value.h"
 
-void disassemble_chunk(Chunk* chunk, const char* name) {
-  printf("[ %s ]\n", name);
+// Names can be slices of the source, so they come with a length.
+void disassemble_chunk(Chunk* chunk, const char* name, int length) {
+  printf("[ %.*s ]\n", length, name);
 
   for (int offset = 0; offset < chunk->count;) {
     offset = disassemble_instruct(chunk, offset);
@@ -57,6 +58,22 @@ static int byte_instruct(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int reg_instruct(const char* name, Chunk* chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+
+  return offset + 3;
+}
+
+static int reg_const_instruct(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 2];
+
+  printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+  print_val(chunk->constants.values[constant]);
+  printf("'\n");
+
+  return offset + 3;
+}
+
 static int jump_instruct(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 
@@ -67,6 +84,128 @@ static int jump_instruct(const char* name, int sign, Chunk* chunk, int offset) {
   return offset + 3;
 }
 
+static int read_short(Chunk* chunk, int offset) {
+  return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int switch_range_instruct(const char* name, Chunk* chunk, int offset) {
+  int lo = (int16_t)read_short(chunk, offset + 1);
+  int count = read_short(chunk, offset + 3);
+  int end = offset + 7 + 2 * count;
+
+  printf("%-16s %4d -> default %d\n", name, offset, end + read_short(chunk, offset + 5));
+
+  for (int s = 0; s < count; s++) {
+    printf("%04d    |           %d -> %d\n", offset + 7 + 2 * s, lo + s, end + read_short(chunk, offset + 7 + 2 * s));
+  }
+
+  return end;
+}
+
+static int switch_hash_instruct(const char* name, Chunk* chunk, int offset) {
+  int capacity = read_short(chunk, offset + 1);
+  int end = offset + 5 + 4 * capacity;
+
+  printf("%-16s %4d -> default %d\n", name, offset, end + read_short(chunk, offset + 3));
+
+  for (int s = 0; s < capacity; s++) {
+    int entry = offset + 5 + 4 * s;
+    int constant = read_short(chunk, entry);
+
+    if (constant == SWITCH_EMPTY) continue;
+
+    printf("%04d    |           `", entry);
+    print_val(chunk->constants.values[constant]);
+    printf("` -> %d\n", end + read_short(chunk, entry + 2));
+  }
+
+  return end;
+}
+
+static int read_wide(Chunk* chunk, int offset) {
+  return chunk->code[offset] | (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+}
+
+static int closure_instruct(const char* name, Chunk* chunk, int offset, int width) {
+  int constant = width == 1 ? chunk->code[offset + 1] : read_wide(chunk, offset + 1);
+
+  offset += 1 + width;
+
+  printf("%-16s %4d ", name, constant);
+  print_val(chunk->constants.values[constant]);
+  printf("\n");
+
+  ObjFunc* function = AS_FUNC(chunk->constants.values[constant]);
+
+  for (int j = 0; j < function->upval_count; j++) {
+    int kind = chunk->code[offset];
+    int index = width == 1 ? chunk->code[offset + 1] : read_wide(chunk, offset + 1);
+
+    printf("%04d    |           %s %d\n", offset,
+      kind == CAPTURE_FLAT ? "flat" : kind == CAPTURE_LOCAL ? "local" : "upval", index);
+    offset += 1 + width;
+  }
+
+  return offset;
+}
+
+// The instruction after OP_WIDE, with 24-bit operands.
+static int wide_instruct(Chunk* chunk, int offset) {
+  uint8_t instruct = chunk->code[offset + 1];
+  int operand = read_wide(chunk, offset + 2);
+  const char* name = NULL;
+
+  switch (instruct) {
+    case OP_GET_LOCAL: name = "WIDE_GET_LOCAL"; break;
+    case OP_SET_LOCAL: name = "WIDE_SET_LOCAL"; break;
+    case OP_GET_UPVAL: name = "WIDE_GET_UPVAL"; break;
+    case OP_SET_UPVAL: name = "WIDE_SET_UPVAL"; break;
+    case OP_GET_FLAT: name = "WIDE_GET_FLAT"; break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      printf("%-16s %4d -> %d\n", instruct == OP_JUMP ? "WIDE_JUMP" : "WIDE_JUMP_IF_FALSE",
+        offset, offset + 5 + operand);
+      return offset + 5;
+    case OP_CLOSURE:
+      return closure_instruct("WIDE_CLOSURE", chunk, offset + 1, 3);
+    case OP_INVOKE:
+    case OP_INVOKE_SUPER:
+      printf("%-16s (%d args) %4d `", instruct == OP_INVOKE ? "WIDE_INVOKE" : "WIDE_INVOKE_SUPER",
+        chunk->code[offset + 5], operand);
+      print_val(chunk->constants.values[operand]);
+      printf("`\n");
+      return offset + 6;
+    default:
+      break;
+  }
+
+  if (name != NULL) {
+    printf("%-16s %4d\n", name, operand);
+    return offset + 5;
+  }
+
+  switch (instruct) {
+    case OP_CONSTANT: name = "WIDE_CONSTANT"; break;
+    case OP_GET_GLOBAL: name = "WIDE_GET_GLOBAL"; break;
+    case OP_DEF_GLOBAL: name = "WIDE_DEF_GLOBAL"; break;
+    case OP_SET_GLOBAL: name = "WIDE_SET_GLOBAL"; break;
+    case OP_GET_PROP: name = "WIDE_GET_PROP"; break;
+    case OP_SET_PROP: name = "WIDE_SET_PROP"; break;
+    case OP_GET_SUPER: name = "WIDE_GET_SUPER"; break;
+    case OP_CLASS: name = "WIDE_CLASS"; break;
+    case OP_METHOD: name = "WIDE_METHOD"; break;
+    default:
+      printf("Unknown or invalid wide opcode `%d`.\n", instruct);
+      return offset + 2;
+  }
+
+  printf("%-16s %4d `", name, operand);
+  print_val(chunk->constants.values[operand]);
+  printf("`\n");
+
+  return offset + 5;
+}
+
 int disassemble_instruct(Chunk* chunk, int offset) {
   printf("%04d ", offset);
 
@@ -108,6 +247,8 @@ int disassemble_instruct(Chunk* chunk, int offset) {
       return byte_instruct("GET_UPVAL", chunk, offset);
     case OP_SET_UPVAL:
       return byte_instruct("SET_UPVAL", chunk, offset);
+    case OP_GET_FLAT:
+      return byte_instruct("GET_FLAT", chunk, offset);
     case OP_GET_PROP:
       return const_instruct("GET_PROP", chunk, offset);
     case OP_SET_PROP:
@@ -122,6 +263,8 @@ int disassemble_instruct(Chunk* chunk, int offset) {
       return simple_instruct("LESS", offset);
     case OP_LARROW:
       return simple_instruct("LARROW", offset);
+    case OP_DUP:
+      return simple_instruct("DUP", offset);
     case OP_ADD:
       return simple_instruct("ADD", offset);
     case OP_SUB:
@@ -140,32 +283,28 @@ int disassemble_instruct(Chunk* chunk, int offset) {
       return jump_instruct("JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
       return jump_instruct("JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_SWITCH_RANGE:
+      return switch_range_instruct("SWITCH_RANGE", chunk, offset);
+    case OP_SWITCH_HASH:
+      return switch_hash_instruct("SWITCH_HASH", chunk, offset);
     case OP_CALL:
       return byte_instruct("CALL", chunk, offset);
+    case OP_CALL_0:
+      return simple_instruct("CALL_0", offset);
+    case OP_CALL_1:
+      return simple_instruct("CALL_1", offset);
+    case OP_CALL_2:
+      return simple_instruct("CALL_2", offset);
+    case OP_CALL_3:
+      return simple_instruct("CALL_3", offset);
     case OP_INVOKE:
       return invoke_instruct("INVOKE", chunk, offset);
     case OP_INVOKE_SUPER:
       return invoke_instruct("INVOKE_SUPER", chunk, offset);
-    case OP_CLOSURE: {
-      offset++;
-
-      uint8_t constant = chunk->code[offset++];
-
-      printf("%-16s %4d ", "CLOSURE", constant);
-      print_val(chunk->constants.values[constant]);
-      printf("\n");
-
-      ObjFunc* function = AS_FUNC(chunk->constants.values[constant]);
-
-      for (int j = 0; j < function->upval_count; j++) {
-        int is_local = chunk->code[offset++];
-        int index = chunk->code[offset++];
-        
-        printf("%04d    |           %s %d\n", offset - 2, is_local ? "local" : "upval", index);
-      }
-
-      return offset;
-    }
+    case OP_CLOSURE:
+      return closure_instruct("CLOSURE", chunk, offset, 1);
+    case OP_MEMO:
+      return simple_instruct("MEMO", offset);
     case OP_CLOSE_UPVAL:
       return simple_instruct("CLOSE_UPVAL", offset);
     case OP_RETURN:
@@ -176,6 +315,58 @@ int disassemble_instruct(Chunk* chunk, int offset) {
       return simple_instruct("INHERIT", offset);
     case OP_METHOD:
       return const_instruct("METHOD", chunk, offset);
+    case OP_ADD_RR:
+      return reg_instruct("ADD_RR", chunk, offset);
+    case OP_ADD_RK:
+      return reg_const_instruct("ADD_RK", chunk, offset);
+    case OP_SUB_RR:
+      return reg_instruct("SUB_RR", chunk, offset);
+    case OP_SUB_RK:
+      return reg_const_instruct("SUB_RK", chunk, offset);
+    case OP_MUL_RR:
+      return reg_instruct("MUL_RR", chunk, offset);
+    case OP_MUL_RK:
+      return reg_const_instruct("MUL_RK", chunk, offset);
+    case OP_DIV_RR:
+      return reg_instruct("DIV_RR", chunk, offset);
+    case OP_DIV_RK:
+      return reg_const_instruct("DIV_RK", chunk, offset);
+    case OP_LESS_RR:
+      return reg_instruct("LESS_RR", chunk, offset);
+    case OP_LESS_RK:
+      return reg_const_instruct("LESS_RK", chunk, offset);
+    case OP_GREATER_RR:
+      return reg_instruct("GREATER_RR", chunk, offset);
+    case OP_GREATER_RK:
+      return reg_const_instruct("GREATER_RK", chunk, offset);
+    case OP_EQU_RR:
+      return reg_instruct("EQU_RR", chunk, offset);
+    case OP_EQU_RK:
+      return reg_const_instruct("EQU_RK", chunk, offset);
+    case OP_MOVE:
+      return reg_instruct("MOVE", chunk, offset);
+    case OP_LOADK:
+      return reg_const_instruct("LOADK", chunk, offset);
+    case OP_STORE:
+      return byte_instruct("STORE", chunk, offset);
+    case OP_ADD_NUM:
+      return simple_instruct("ADD_NUM", offset);
+    case OP_SUB_NUM:
+      return simple_instruct("SUB_NUM", offset);
+    case OP_MUL_NUM:
+      return simple_instruct("MUL_NUM", offset);
+    case OP_DIV_NUM:
+      return simple_instruct("DIV_NUM", offset);
+    case OP_LESS_NUM:
+      return simple_instruct("LESS_NUM", offset);
+    case OP_GREATER_NUM:
+      return simple_instruct("GREATER_NUM", offset);
+    case OP_EQU_NUM:
+      return simple_instruct("EQU_NUM", offset);
+    case OP_NEGATE_NUM:
+      return simple_instruct("NEGATE_NUM", offset);
+    case OP_WIDE:
+      return wide_instruct(chunk, offset);
     default:
       printf("Unknown or invalid opcode `%d`.\n", instruct);
       return offset + 1;
@@ -0,0 +1,36 @@
+#ifndef nvmbr_aot_h
+#define nvmbr_aot_h
+#include <stdio.h>
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+  `nvmbrc --emit-c` translates a script into a C file with
+  one AotFn per function. Built against libnvmbr.a, it runs
+  the script with those bodies in place of the bytecode,
+  handing back to run() the same way JIT code does.
+*/
+
+bool emit_c(ObjFunc* script, const char* path);
+// The main of a generated program. Returns its exit code.
+int aot_main(const uint8_t* image, size_t size, uint32_t options, const AotFn* bodies, int body_count);
+
+// What the generated code uses, with `frame` and `slots` in scope.
+#define AOT_CONST(index) (frame->closure->function->chunk.constants.values[index])
+#define AOT_AT(offset) (frame->closure->function->chunk.code + (offset))
+// Brings the VM up to date once the locals have been spilled.
+#define AOT_SYNC(offset, depth) (vm.stack_top = slots + (depth), frame->ip = AOT_AT(offset))
+
+static inline bool aot_falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static inline bool aot_equ(Value a, Value b) {
+  if (IS_NUM(a) && IS_NUM(b)) return AS_NUM(a) == AS_NUM(b);
+
+  return value_equ(a, b);
+}
+
+#endif
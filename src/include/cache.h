@@ -0,0 +1,23 @@
+#ifndef nvmbr_cache_h
+#define nvmbr_cache_h
+#include "common.h"
+#include "object.h"
+
+/*
+  Bump this whenever the bytecode or the layout of a .nvmc
+  file changes, so stale caches are recompiled instead of
+  being run.
+*/
+#define NVM_BYTECODE_VERSION 12
+
+uint64_t hash_source(const char* src, size_t length);
+// `options` is what compile_options() was when the script was compiled.
+bool write_cache(ObjFunc* function, const char* path, uint64_t src_hash, uint32_t options);
+// Sets `stale` when there is a file, but for other source, options or version.
+ObjFunc* load_cache(const char* path, uint64_t src_hash, uint32_t options, bool* stale);
+// The bytes of a .nvmc file, malloc'd, or NULL if it can't be cached.
+uint8_t* cache_image(ObjFunc* function, uint64_t src_hash, uint32_t options, size_t* size);
+// Loads from bytes that outlive the script, as the code borrows them.
+ObjFunc* load_image(const uint8_t* bytes, size_t size, uint64_t src_hash, uint32_t options);
+void free_cache();
+#endif
@@ -17,6 +17,8 @@ typedef enum {
 	OP_SET_GLOBAL,
 	OP_GET_UPVAL,
 	OP_SET_UPVAL,
+	// Reads an upvalue captured by value, see CAPTURE_FLAT.
+	OP_GET_FLAT,
 	OP_GET_PROP,
 	OP_SET_PROP,
 	OP_GET_SUPER,
@@ -34,17 +36,72 @@ typedef enum {
 	OP_PRINT,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
+	// Jump tables for `match`, see match_statement.
+	OP_SWITCH_RANGE,
+	OP_SWITCH_HASH,
 	OP_CALL,
+	// Calls with the argument count in the opcode.
+	OP_CALL_0,
+	OP_CALL_1,
+	OP_CALL_2,
+	OP_CALL_3,
 	OP_INVOKE,
 	OP_INVOKE_SUPER,
 	OP_CLOSURE,
+	// Gives the closure a memo table, see memo_decl.
+	OP_MEMO,
 	OP_CLOSE_UPVAL,
 	OP_RETURN,
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
+	// Register forms, see to_registers. Each reads its left operand
+	// from a frame slot, and its right from a slot (RR) or a
+	// constant (RK), then pushes the result.
+	OP_ADD_RR,
+	OP_ADD_RK,
+	OP_SUB_RR,
+	OP_SUB_RK,
+	OP_MUL_RR,
+	OP_MUL_RK,
+	OP_DIV_RR,
+	OP_DIV_RK,
+	OP_LESS_RR,
+	OP_LESS_RK,
+	OP_GREATER_RR,
+	OP_GREATER_RK,
+	OP_EQU_RR,
+	OP_EQU_RK,
+	// Copies a slot, a constant or the popped value into a slot.
+	OP_MOVE,
+	OP_LOADK,
+	OP_STORE,
+	// Ops whose operands are known to be numbers, see specialize.
+	OP_ADD_NUM,
+	OP_SUB_NUM,
+	OP_MUL_NUM,
+	OP_DIV_NUM,
+	OP_LESS_NUM,
+	OP_GREATER_NUM,
+	OP_EQU_NUM,
+	OP_NEGATE_NUM,
+	// Prefix giving the next instruction 24-bit operands.
+	OP_WIDE,
 } OpCode;
 
+// The largest operand OP_WIDE can carry.
+#define WIDE_MAX 0xffffff
+// How OP_CLOSURE captures each of its upvalues. Locals that
+// never change once captured are copied into the closure.
+typedef enum {
+	CAPTURE_UPVAL,
+	CAPTURE_LOCAL,
+	CAPTURE_FLAT,
+} CaptureKind;
+
+// Marks an empty slot in an OP_SWITCH_HASH table.
+#define SWITCH_EMPTY 0xffff
+
 typedef struct {
 	int offset;
 	int line;
@@ -58,13 +115,20 @@ typedef struct {
   int line_capacity;
 	LineStart* lines;
 	ValueArray constants;
+	// Finds existing constants while compiling, freed after.
+	int index_capacity;
+	int* const_index;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
+void truncate_chunk(Chunk* chunk, int count);
 void write_const(Chunk* chunk, Value value, int line);
 int add_const(Chunk* chunk, Value value);
+void free_const_index(Chunk* chunk);
+int instruct_length(Chunk* chunk, int offset);
+int stack_effect(Chunk* chunk, int offset);
 int get_line(Chunk* chunk, int instruct);
 
 #endif
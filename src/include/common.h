@@ -37,5 +37,12 @@
   functioning properly.
 */
 // #define DEBUG_LOG_GC
+
+/*
+  Keeps the top of the stack in a local variable while
+  the common ops run, instead of going through memory.
+  Build with `make FLAGS="-Wall -O2 -DSTACK_CACHING"`.
+*/
+// #define STACK_CACHING
 #define UINT8_COUNT (UINT8_MAX + 1)
 #endif
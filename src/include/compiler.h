@@ -3,5 +3,14 @@
 #include "vm.h"
 #include "object.h"
 ObjFunc* compile(const char* src);
+ObjFunc* compile_lazy(const char* src);
+bool compile_body(ObjFunc* function);
+void free_lazy(struct LazyBody* lazy);
+void set_opt_level(int level);
+void set_reg_mode(bool enabled);
+// The settings that change the bytecode, which .nvmc files record:
+// the -O level in the low byte, and COMPILE_REG for --reg.
+#define COMPILE_REG 0x100
+uint32_t compile_options();
 void mark_compiler_root();
 #endif
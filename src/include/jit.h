@@ -0,0 +1,46 @@
+#ifndef nvmbr_jit_h
+#define nvmbr_jit_h
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// The JIT emits x86-64 and leans on the NaN-boxed layout of values.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_TAGGING)
+#define NVM_JIT
+#endif
+
+// Calls a function takes before it is compiled to native code.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+// Why native code handed control back to run().
+typedef enum {
+  // A runtime error has been reported.
+  JIT_ERROR,
+  // run() should carry out the instruction at frame->ip itself.
+  JIT_STEP,
+  // A call pushed a frame, which run() should pick up.
+  JIT_SWITCH,
+} JitStatus;
+
+typedef struct JitCode {
+  uint8_t* code;
+  size_t size;
+  // The native offset of each instruction, by bytecode offset.
+  int32_t* at;
+  int at_count;
+} JitCode;
+
+bool init_jit();
+void jit_compile(ObjFunc* function);
+JitStatus jit_run(CallFrame* frame);
+void free_jit(JitCode* jit);
+
+// Slow paths in vm.c the native code calls, with vm.stack_top up to date.
+bool jit_get_global(ObjString* name);
+bool jit_get_prop(ObjString* name);
+int jit_call(int arg_count);
+int jit_invoke(ObjString* name, int arg_count);
+
+#endif
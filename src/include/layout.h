@@ -0,0 +1,17 @@
+#ifndef nvmbr_layout_h
+#define nvmbr_layout_h
+#include "common.h"
+#include "object.h"
+
+/*
+  Once a script is compiled, pack_code moves the bytecode of
+  every function into one read-only mapping, function bodies
+  first and the script's own code, which runs once, last. The
+  line tables, only read for errors, go after all the code.
+  The chunks borrow from the mapping the way cached ones
+  borrow from the .nvmc file.
+*/
+void pack_code(ObjFunc* script);
+void free_code();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef nvmbr_memo_h
+#define nvmbr_memo_h
+#include "common.h"
+#include "value.h"
+
+typedef struct {
+  uint32_t hash;
+  // Changes each time the entry is reused, so a call that
+  // outlived its entry doesn't store into someone else's.
+  uint32_t id;
+  // False until the call that made the entry returns.
+  bool done;
+  // The next entry in the same bucket.
+  int chain;
+  // Neighbours in use order, kept only when the table has a limit.
+  int newer;
+  int older;
+  Value result;
+} MemoEntry;
+
+/*
+  The results of a `memo func`, keyed by the bits of its
+  arguments. Entries are chained in buckets by the hash of
+  those arguments. A table with a limit drops its least
+  recently used entry once full.
+*/
+typedef struct Memo {
+  int arity;
+  // The most entries kept, 0 for no limit.
+  int limit;
+  int count;
+  int capacity;
+  MemoEntry* entries;
+  // Entry i's arguments start at args[i * arity].
+  Value* args;
+  int bucket_count;
+  int* buckets;
+  int newest;
+  int oldest;
+  uint32_t next_id;
+} Memo;
+
+Memo* new_memo(int arity, int limit);
+void free_memo(Memo* memo);
+void mark_memo(Memo* memo);
+uint32_t hash_args(Value* args, int count);
+bool get_memo(Memo* memo, Value* args, uint32_t hash, Value* result);
+int add_memo(Memo* memo, Value* args, uint32_t hash);
+void set_memo(Memo* memo, int index, uint32_t id, Value result);
+
+#endif
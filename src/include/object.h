@@ -23,6 +23,7 @@
 #define AS_NATIVE(value) \
   (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)  ((ObjString*)AS_OBJ(value))
+#define AS_UPVAL(value)   ((ObjUpval*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
@@ -42,26 +43,73 @@ struct Obj {
   struct Obj* next;
 };
 
+// Bodies simple enough for call() to run without a frame.
+typedef enum {
+  TRIVIAL_NONE,
+  // Returns `trivial_value`.
+  TRIVIAL_CONST,
+  // Returns the local in `trivial_slot`.
+  TRIVIAL_LOCAL,
+  // Returns the field of `this` named by `trivial_value`.
+  TRIVIAL_GETTER,
+  // Sets that field to its argument and returns nil.
+  TRIVIAL_SETTER,
+} TrivialKind;
+
+struct CallFrame;
+
+// Runs a frame in native code, returning a JitStatus.
+typedef int (*AotFn)(struct CallFrame* frame);
+
 typedef struct {
   Obj obj;
   int arity;
   int upval_count;
   Chunk chunk;
   ObjString* name;
+  // Set while the body is still waiting to be compiled.
+  struct LazyBody* lazy;
+  // The value is one of the chunk's constants, so it needs no marking.
+  TrivialKind trivial;
+  int trivial_slot;
+  Value trivial_value;
+  // Where the copy of the code for all-number arguments starts, or 0.
+  int fast_entry;
+  // The most stack slots a frame of this function uses, counting the callee.
+  int max_stack;
+  // Which slots the collector can leave alone, see find_live.
+  struct LiveMap* live;
+  // Native code once the function has been called JIT_THRESHOLD times under --jit.
+  struct JitCode* jit;
+  // Stops at JIT_THRESHOLD, so it never overflows or compiles twice.
+  int calls;
+  // The body compiled ahead of time by --emit-c, see aot.h.
+  AotFn aot;
 } ObjFunc;
 
-typedef Value (*NativeFn)(int arg_count, Value* args);
+/*
+  Natives write their result into args[-1], the callee's
+  slot. Returning false means the native already reported
+  a runtime error.
+*/
+typedef bool (*NativeFn)(int arg_count, Value* args);
 
 typedef struct {
   Obj obj;
   NativeFn function;
 } ObjNative;
 
+/*
+  A string either owns its chars, or is a slice viewing the
+  chars of `owner`. Slices are not null terminated, so always
+  go through `length`.
+*/
 struct ObjString {
   Obj obj;
   int length;
   char* chars;
   uint32_t hash;
+  struct ObjString* owner;
 };
 
 typedef struct ObjUpval {
@@ -74,14 +122,23 @@ typedef struct ObjUpval {
 typedef struct {
   Obj obj;
   ObjFunc* function;
-  ObjUpval** upvals;
+  // Values captured flat, or the ObjUpval boxing a variable.
+  Value* upvals;
   int upval_count;
+  // The results of a `memo func`, NULL for any other closure.
+  struct Memo* memo;
 } ObjClose;
 
-typedef struct {
+typedef struct ObjClass {
   Obj obj;
   ObjString* name;
+  // The class whose `methods` hold this class's full set of
+  // methods. A subclass shares its superclass's table until it
+  // defines a method of its own, and only then copies it.
+  struct ObjClass* methods_from;
   Table methods;
+  // The `init` method, kept here so constructing skips the lookup.
+  ObjClose* initializer;
 } ObjClass;
 
 typedef struct {
@@ -105,6 +162,7 @@ ObjInst* new_inst(ObjClass* klass);
 ObjNative* new_native(NativeFn function);
 ObjString* take_string(char* chars, int length);
 ObjString* copy_string(const char* chars, int length);
+ObjString* slice_string(ObjString* string, int start, int length);
 ObjUpval* new_upval(Value* slot);
 void print_obj(Value value);
 
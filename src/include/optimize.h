@@ -0,0 +1,38 @@
+#ifndef nvmbr_optimize_h
+#define nvmbr_optimize_h
+#include "chunk.h"
+#include "object.h"
+
+// -O1 removes code that can't run and threads jumps, -O2 also
+// drops pushes that are popped straight away and constant branches.
+#define OPT_MAX 2
+
+void optimize_chunk(Chunk* chunk, int level);
+void to_registers(Chunk* chunk);
+void find_trivial(ObjFunc* function);
+void specialize(ObjFunc* function);
+void find_max_stack(ObjFunc* function);
+
+// An instruction the collector can run in the middle of.
+typedef struct {
+  int offset;
+  int length;
+  // The height of the stack as it starts.
+  int height;
+} Safepoint;
+
+// The frame slots still to be read at each safepoint, see find_live.
+typedef struct LiveMap {
+  int count;
+  // The words in each safepoint's set of slots.
+  int words;
+  Safepoint* points;
+  uint32_t* live;
+} LiveMap;
+
+void find_live(ObjFunc* function);
+void free_live(LiveMap* map);
+// The slots still to be read by a frame at `ip`, or NULL if that isn't known.
+const uint32_t* live_slots(ObjFunc* function, uint8_t* ip, int* height);
+
+#endif
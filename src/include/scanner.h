@@ -59,6 +59,7 @@ typedef enum {
   T_CASE,
   T_DEFAULT,
   T_MATCH,
+  T_MEMO,
 
   T_ERR,
   T_EOS,
@@ -71,6 +72,15 @@ typedef struct {
   int line;
 } Token;
 
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+// Exposed so the compiler can come back to a function body later.
+extern Scanner scanner;
+
 void init_scanner(const char* src);
 Token scan_token();
 
@@ -0,0 +1,6 @@
+#ifndef nvmbr_strlib_h
+#define nvmbr_strlib_h
+#include "common.h"
+void define_strlib();
+int find_bytes(const char* hay, int hay_length, const char* needle, int needle_length);
+#endif
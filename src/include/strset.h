@@ -0,0 +1,25 @@
+#ifndef nvmbr_strset_h
+#define nvmbr_strset_h
+#include "common.h"
+#include "value.h"
+
+/*
+  The string intern set. Unlike a Table it only stores
+  the key pointers, plus each key's hash so most probes
+  are rejected without touching the string itself.
+  Removal uses backward shifting, so there are never any
+  tombstones left behind after a weak sweep.
+*/
+typedef struct {
+  int count;
+  int capacity;
+  ObjString** keys;
+  uint32_t* hashes;
+} StrSet;
+
+void init_strset(StrSet* set);
+void free_strset(StrSet* set);
+void strset_add(StrSet* set, ObjString* key);
+ObjString* strset_find(StrSet* set, const char* chars, int length, uint32_t hash);
+void strset_rmwhi(StrSet* set);
+#endif
@@ -2,6 +2,29 @@
 #define nvmbr_table_h
 #include "common.h"
 #include "value.h"
+
+/*
+  Tables are split into groups of TABLE_GROUP slots. Each
+  slot has a control byte holding either EMPTY, DELETED or
+  7 bits of the key's hash, so a whole group can be checked
+  for a key in a couple of SIMD compares before any entry
+  is touched.
+*/
+#define TABLE_GROUP 16
+
+/*
+  Up to TABLE_SMALL entries are kept inline in the Table
+  itself and found by comparing key pointers one after the
+  other, which is all most fields and methods tables ever
+  need. The grouped layout is only built past that.
+
+  That makes every Table 144 bytes, empty or not. It is
+  still less than the 24 bytes plus a 272-byte block an
+  instance paid for its first field before, and instances
+  with fields far outnumber empty tables.
+*/
+#define TABLE_SMALL 8
+
 typedef struct {
   ObjString* key;
   Value value;
@@ -9,8 +32,19 @@ typedef struct {
 
 typedef struct {
   int count;
+  int tombstones;
+  // Zero while the table is small.
   int capacity;
-  Entry* entries;
+  union {
+    struct {
+      int8_t* ctrl;
+      Entry* entries;
+    } hashed;
+    struct {
+      ObjString* keys[TABLE_SMALL];
+      Value values[TABLE_SMALL];
+    } small;
+  } as;
 } Table;
 
 void init_table(Table* table);
@@ -19,7 +53,5 @@ bool get_table(Table* table, ObjString* key, Value* value);
 bool set_table(Table* table, ObjString* key, Value value);
 bool del_table(Table* table, ObjString* key);
 void table_add_all(Table* from, Table* to);
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
-void table_rmwhi(Table* table);
 void mark_table(Table* table);
 #endif
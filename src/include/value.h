@@ -88,6 +88,8 @@ typedef struct {
 } ValueArray;
 
 bool value_equ(Value a, Value b);
+uint32_t hash_value(Value value);
+uint64_t value_bits(Value value);
 void init_val_arr(ValueArray* array);
 void write_val_arr(ValueArray* array, Value value);
 void free_val_arr(ValueArray* array);
@@ -4,12 +4,19 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "strset.h"
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
-typedef struct {
+// Room above a frame's own slots for values the VM and natives
+// push for a moment, to keep them alive while allocating.
+#define STACK_RESERVE 8
+typedef struct CallFrame {
   ObjClose* closure;
   uint8_t* ip;
   Value* slots;
+  // The memo entry awaiting this call's result, if the closure has a memo.
+  int memo_index;
+  uint32_t memo_id;
 } CallFrame;
 
 typedef struct {
@@ -18,8 +25,9 @@ typedef struct {
   Value stack[STACK_MAX];
   Value* stack_top;
   Table globals;
-  Table strings;
+  StrSet strings;
   ObjString* init_string;
+  ObjClass* pair_class;
   ObjUpval* open_upvals;
   size_t alloced_bytes;
   size_t next_gc;
@@ -27,6 +35,10 @@ typedef struct {
   int gcount;
   int gcap;
   Obj** gstack;
+  // Set by --jit, see jit.h.
+  bool jit;
+  // Set when running a program built from --emit-c, see aot.h.
+  bool aot;
 } VM;
 
 typedef enum {
@@ -40,6 +52,9 @@ extern VM vm;
 void init_vm();
 void free_vm();
 InterpResult interp(const char* src);
+InterpResult interp_func(ObjFunc* function);
+void runtime_err(const char* format, ...);
+void define_native(const char* name, NativeFn function);
 void push(Value value);
 Value pop();
 #endif
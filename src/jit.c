@@ -0,0 +1,703 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/jit.h"
+#include "include/memory.h"
+
+#ifdef NVM_JIT
+#include <unistd.h>
+#include <sys/mman.h>
+
+// All native code shares one mapping, so it can reach the entry and exit stubs with rel32 jumps.
+#define JIT_REGION (16 * 1024 * 1024)
+// Enough room for any one instruction's template.
+#define JIT_MAX_INSTRUCT 192
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Registers native code keeps while it runs.
+#define SLOTS RBX
+#define TOP   R12
+#define FRAME R13
+#define NAN   R15
+
+// Condition codes for jump().
+#define JMP 0x00
+#define JE  0x84
+#define JB  0x82
+#define JA  0x87
+
+typedef int (*JitEntry)(CallFrame* frame, Value* slots, Value* stack_top, uint8_t* target);
+
+typedef struct {
+  uint8_t* base;
+  size_t used;
+  uint8_t* enter;
+  uint8_t* leave;
+  FILE* perf_map;
+} Region;
+
+typedef struct {
+  uint8_t* at;
+  int target;
+} Fixup;
+
+static Region region;
+static uint8_t* out;
+
+static void byte(uint8_t value) {
+  *out++ = value;
+}
+
+static void u32(uint32_t value) {
+  memcpy(out, &value, 4);
+  out += 4;
+}
+
+static void u64(uint64_t value) {
+  memcpy(out, &value, 8);
+  out += 8;
+}
+
+static void rex(int reg, int rm) {
+  byte(0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+}
+
+// `op reg, [base + disp]`, always with a 32-bit displacement.
+static void mem_op(uint8_t op, int reg, int base, int32_t disp) {
+  rex(reg, base);
+  byte(op);
+  byte(0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) byte(0x24);
+  u32((uint32_t)disp);
+}
+
+static void load(int reg, int base, int32_t disp) {
+  mem_op(0x8b, reg, base, disp);
+}
+
+static void store(int base, int32_t disp, int reg) {
+  mem_op(0x89, reg, base, disp);
+}
+
+// `op rm, reg` between two registers, for mov, add, and, cmp and the like.
+static void reg_op(uint8_t op, int rm, int reg) {
+  rex(reg, rm);
+  byte(op);
+  byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void mov(int dst, int src) {
+  reg_op(0x89, dst, src);
+}
+
+static void movabs(int reg, uint64_t value) {
+  rex(0, reg);
+  byte(0xb8 + (reg & 7));
+  u64(value);
+}
+
+static void add_imm(int reg, int32_t value) {
+  rex(0, reg);
+  byte(0x81);
+  byte(0xc0 | (reg & 7));
+  u32((uint32_t)value);
+}
+
+// `mov r32, imm32`, for the low registers only.
+static void mov_imm32(int reg, uint32_t value) {
+  byte(0xb8 + reg);
+  u32(value);
+}
+
+static void movq_to_xmm(int xmm, int reg) {
+  byte(0x66);
+  rex(xmm, reg);
+  byte(0x0f);
+  byte(0x6e);
+  byte(0xc0 | (xmm << 3) | (reg & 7));
+}
+
+static void movq_from_xmm(int reg, int xmm) {
+  byte(0x66);
+  rex(xmm, reg);
+  byte(0x0f);
+  byte(0x7e);
+  byte(0xc0 | (xmm << 3) | (reg & 7));
+}
+
+static void sse(uint8_t prefix, uint8_t op, int dst, int src) {
+  byte(prefix);
+  byte(0x0f);
+  byte(op);
+  byte(0xc0 | (dst << 3) | src);
+}
+
+static void setcc(uint8_t cc, int reg) {
+  byte(0x0f);
+  byte(cc);
+  byte(0xc0 | reg);
+}
+
+// `movzx eax, al`.
+static void widen_al() {
+  byte(0x0f);
+  byte(0xb6);
+  byte(0xc0);
+}
+
+// Emits a jump, or a conditional one, returning its offset to patch.
+static uint8_t* jump(uint8_t cc) {
+  if (cc == JMP) {
+    byte(0xe9);
+  }
+  else {
+    byte(0x0f);
+    byte(cc);
+  }
+
+  uint8_t* at = out;
+
+  u32(0);
+  return at;
+}
+
+static void patch(uint8_t* at, uint8_t* target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+
+  memcpy(at, &rel, 4);
+}
+
+static void push_reg(int reg) {
+  store(TOP, 0, reg);
+  add_imm(TOP, 8);
+}
+
+static void pop_reg(int reg) {
+  add_imm(TOP, -8);
+  load(reg, TOP, 0);
+}
+
+static void peek_reg(int reg, int dist) {
+  load(reg, TOP, -8 * (dist + 1));
+}
+
+static void set_ip(uint8_t* ip) {
+  movabs(RAX, (uint64_t)(uintptr_t)ip);
+  store(FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+static void leave(uint8_t* ip, JitStatus status) {
+  set_ip(ip);
+  mov_imm32(RAX, status);
+  patch(jump(JMP), region.leave);
+}
+
+static void fail() {
+  mov_imm32(RAX, JIT_ERROR);
+  patch(jump(JMP), region.leave);
+}
+
+// Calls a slow path in vm.c with the stack top flushed, and reloads it after.
+static void call_helper(void* helper) {
+  movabs(RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+  store(RCX, 0, TOP);
+  movabs(RAX, (uint64_t)(uintptr_t)helper);
+  byte(0xff);
+  byte(0xd0);
+  movabs(RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+  load(TOP, RCX, 0);
+}
+
+// Jumps away unless `reg` holds a number, clobbering RSI.
+static uint8_t* unless_num(int reg) {
+  mov(RSI, reg);
+  reg_op(0x21, RSI, NAN);
+  reg_op(0x39, RSI, NAN);
+
+  return jump(JE);
+}
+
+// Turns the 0 or 1 in AL into false or true in RAX.
+static void bool_from_al() {
+  widen_al();
+  movabs(RCX, FALSE_VAL);
+  reg_op(0x01, RAX, RCX);
+}
+
+// The SSE2 opcode for an arithmetic op, as in `addsd xmm0, xmm1`.
+static uint8_t sse_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD: return 0x58;
+    case OP_SUB: return 0x5c;
+    case OP_MUL: return 0x59;
+    default:     return 0x5e;
+  }
+}
+
+// RAX op RDX into RAX, for numbers.
+static void numeric(uint8_t op) {
+  movq_to_xmm(0, RAX);
+  movq_to_xmm(1, RDX);
+
+  switch (op) {
+    case OP_LESS:
+      sse(0x66, 0x2e, 1, 0);
+      setcc(0x97, RAX);
+      bool_from_al();
+      return;
+    case OP_GREATER:
+      sse(0x66, 0x2e, 0, 1);
+      setcc(0x97, RAX);
+      bool_from_al();
+      return;
+    default:
+      sse(0xf2, sse_op(op), 0, 1);
+      movq_from_xmm(RAX, 0);
+      return;
+  }
+}
+
+// Whether RAX equals RDX, into RAX. Numbers compare as doubles, anything else by its bits.
+static void equal() {
+  uint8_t* a_bits = unless_num(RAX);
+  uint8_t* b_bits = unless_num(RDX);
+
+  movq_to_xmm(0, RAX);
+  movq_to_xmm(1, RDX);
+  sse(0x66, 0x2e, 0, 1);
+  setcc(0x94, RAX);
+  setcc(0x9b, RCX);
+  byte(0x20);
+  byte(0xc8);
+
+  uint8_t* done = jump(JMP);
+
+  patch(a_bits, out);
+  patch(b_bits, out);
+  reg_op(0x39, RAX, RDX);
+  setcc(0x94, RAX);
+  patch(done, out);
+  bool_from_al();
+}
+
+// Whether RAX is falsey, into RAX as a value.
+static void falsey() {
+  movabs(RCX, NIL_VAL);
+  reg_op(0x39, RAX, RCX);
+  setcc(0x94, RDX);
+  movabs(RCX, FALSE_VAL);
+  reg_op(0x39, RAX, RCX);
+  setcc(0x94, RAX);
+  byte(0x08);
+  byte(0xd0);
+  bool_from_al();
+}
+
+// The stack op behind a register or number-only form.
+static uint8_t stack_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_RR: case OP_ADD_RK: case OP_ADD_NUM: return OP_ADD;
+    case OP_SUB_RR: case OP_SUB_RK: case OP_SUB_NUM: return OP_SUB;
+    case OP_MUL_RR: case OP_MUL_RK: case OP_MUL_NUM: return OP_MUL;
+    case OP_DIV_RR: case OP_DIV_RK: case OP_DIV_NUM: return OP_DIV;
+    case OP_LESS_RR: case OP_LESS_RK: case OP_LESS_NUM: return OP_LESS;
+    case OP_GREATER_RR: case OP_GREATER_RK: case OP_GREATER_NUM: return OP_GREATER;
+    default: return OP_EQU;
+  }
+}
+
+static bool is_rk(uint8_t op) {
+  return op == OP_ADD_RK || op == OP_SUB_RK || op == OP_MUL_RK || op == OP_DIV_RK ||
+    op == OP_LESS_RK || op == OP_GREATER_RK || op == OP_EQU_RK;
+}
+
+// A call that may push a frame: 0 is an error, 1 finished in place and 2 pushed a frame.
+static void after_call(uint8_t* next) {
+  byte(0x83);
+  byte(0xf8);
+  byte(0x01);
+
+  uint8_t* error = jump(JB);
+  uint8_t* pushed = jump(JA);
+  uint8_t* done = jump(JMP);
+
+  patch(error, out);
+  fail();
+  patch(pushed, out);
+  leave(next, JIT_SWITCH);
+  patch(done, out);
+}
+
+static void after_bool() {
+  byte(0x84);
+  byte(0xc0);
+
+  uint8_t* ok = jump(0x85);
+
+  fail();
+  patch(ok, out);
+}
+
+// Emits the template for one instruction, recording any bytecode jumps in `fixups`.
+static void emit_instruct(Chunk* chunk, int offset, Fixup* fixups, int* fixup_count) {
+  uint8_t* ip = &chunk->code[offset];
+  uint8_t* next = ip + instruct_length(chunk, offset);
+  Value* constants = chunk->constants.values;
+  uint8_t op = ip[0];
+
+  switch (op) {
+    case OP_CONSTANT:
+      movabs(RAX, constants[ip[1]]);
+      push_reg(RAX);
+      return;
+    case OP_CONSTANT_LONG:
+      movabs(RAX, constants[ip[1] | (ip[2] << 8) | (ip[3] << 16)]);
+      push_reg(RAX);
+      return;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      movabs(RAX, op == OP_NIL ? NIL_VAL : op == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+      push_reg(RAX);
+      return;
+    case OP_POP:
+      add_imm(TOP, -8);
+      return;
+    case OP_DUP:
+      peek_reg(RAX, 0);
+      push_reg(RAX);
+      return;
+    case OP_GET_LOCAL:
+      load(RAX, SLOTS, 8 * ip[1]);
+      push_reg(RAX);
+      return;
+    case OP_SET_LOCAL:
+      peek_reg(RAX, 0);
+      store(SLOTS, 8 * ip[1], RAX);
+      return;
+    case OP_STORE:
+      pop_reg(RAX);
+      store(SLOTS, 8 * ip[1], RAX);
+      return;
+    case OP_MOVE:
+      load(RAX, SLOTS, 8 * ip[2]);
+      store(SLOTS, 8 * ip[1], RAX);
+      return;
+    case OP_LOADK:
+      movabs(RAX, constants[ip[2]]);
+      store(SLOTS, 8 * ip[1], RAX);
+      return;
+    case OP_GET_FLAT:
+      load(RAX, FRAME, offsetof(CallFrame, closure));
+      load(RAX, RAX, offsetof(ObjClose, upvals));
+      load(RAX, RAX, 8 * ip[1]);
+      push_reg(RAX);
+      return;
+    case OP_EQU:
+      peek_reg(RAX, 1);
+      peek_reg(RDX, 0);
+      equal();
+      add_imm(TOP, -8);
+      store(TOP, -8, RAX);
+      return;
+    case OP_NOT:
+      peek_reg(RAX, 0);
+      falsey();
+      store(TOP, -8, RAX);
+      return;
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+    case OP_EQU_NUM:
+      peek_reg(RAX, 1);
+      peek_reg(RDX, 0);
+
+      if (op == OP_EQU_NUM) equal();
+      else numeric(stack_op(op));
+
+      add_imm(TOP, -8);
+      store(TOP, -8, RAX);
+      return;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE: {
+      int target = (int)(next - chunk->code) + ((ip[1] << 8) | ip[2]);
+
+      if (op == OP_JUMP) {
+        fixups[(*fixup_count)++] = (Fixup){ jump(JMP), target };
+        return;
+      }
+
+      peek_reg(RAX, 0);
+      movabs(RCX, NIL_VAL);
+      reg_op(0x39, RAX, RCX);
+      fixups[(*fixup_count)++] = (Fixup){ jump(JE), target };
+      movabs(RCX, FALSE_VAL);
+      reg_op(0x39, RAX, RCX);
+      fixups[(*fixup_count)++] = (Fixup){ jump(JE), target };
+      return;
+    }
+    case OP_GET_GLOBAL:
+    case OP_GET_PROP:
+      set_ip(next);
+      movabs(RDI, (uint64_t)(uintptr_t)AS_OBJ(constants[ip[1]]));
+      call_helper(op == OP_GET_GLOBAL ? (void*)jit_get_global : (void*)jit_get_prop);
+      after_bool();
+      return;
+    case OP_CALL:
+    case OP_CALL_0:
+    case OP_CALL_1:
+    case OP_CALL_2:
+    case OP_CALL_3:
+      set_ip(next);
+      mov_imm32(RDI, op == OP_CALL ? ip[1] : op - OP_CALL_0);
+      call_helper((void*)jit_call);
+      after_call(next);
+      return;
+    case OP_INVOKE:
+      set_ip(next);
+      movabs(RDI, (uint64_t)(uintptr_t)AS_OBJ(constants[ip[1]]));
+      mov_imm32(RSI, ip[2]);
+      call_helper((void*)jit_invoke);
+      after_call(next);
+      return;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUB_RR:
+    case OP_SUB_RK:
+    case OP_MUL_RR:
+    case OP_MUL_RK:
+    case OP_DIV_RR:
+    case OP_DIV_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+    case OP_EQU_RR:
+    case OP_EQU_RK:
+      break;
+    default:
+      leave(ip, JIT_STEP);
+      return;
+  }
+
+  // Numbers run inline, anything else is left to run().
+  uint8_t* slow[2];
+  int slow_count = 0;
+  bool reg = op >= OP_ADD_RR;
+
+  if (op == OP_NEGATE || op == OP_NEGATE_NUM) {
+    peek_reg(RAX, 0);
+
+    if (op == OP_NEGATE) slow[slow_count++] = unless_num(RAX);
+
+    // btc rax, 63
+    byte(0x48);
+    byte(0x0f);
+    byte(0xba);
+    byte(0xf8);
+    byte(0x3f);
+    store(TOP, -8, RAX);
+  }
+  else if (reg) {
+    load(RAX, SLOTS, 8 * ip[1]);
+
+    if (is_rk(op)) movabs(RDX, constants[ip[2]]);
+    else load(RDX, SLOTS, 8 * ip[2]);
+
+    if (stack_op(op) == OP_EQU) {
+      equal();
+    }
+    else {
+      slow[slow_count++] = unless_num(RAX);
+
+      if (!is_rk(op)) slow[slow_count++] = unless_num(RDX);
+      else if (!IS_NUM(constants[ip[2]])) slow[slow_count++] = jump(JMP);
+
+      numeric(stack_op(op));
+    }
+    push_reg(RAX);
+  }
+  else {
+    peek_reg(RAX, 1);
+    peek_reg(RDX, 0);
+    slow[slow_count++] = unless_num(RAX);
+    slow[slow_count++] = unless_num(RDX);
+    numeric(op);
+    add_imm(TOP, -8);
+    store(TOP, -8, RAX);
+  }
+
+  if (slow_count == 0) return;
+
+  uint8_t* done = jump(JMP);
+
+  for (int i = 0; i < slow_count; i++) patch(slow[i], out);
+
+  leave(ip, JIT_STEP);
+  patch(done, out);
+}
+
+static void emit_stubs() {
+  out = region.base;
+
+  // Saves the callee-saved registers and keeps the stack 16-byte aligned for helper calls.
+  region.enter = out;
+  byte(0x53);
+  byte(0x55);
+  byte(0x41); byte(0x54);
+  byte(0x41); byte(0x55);
+  byte(0x41); byte(0x56);
+  byte(0x41); byte(0x57);
+  byte(0x48); byte(0x83); byte(0xec); byte(0x08);
+  mov(FRAME, RDI);
+  mov(SLOTS, RSI);
+  mov(TOP, RDX);
+  movabs(NAN, QNAN);
+  byte(0xff);
+  byte(0xe1);
+
+  region.leave = out;
+  movabs(RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+  store(RCX, 0, TOP);
+  byte(0x48); byte(0x83); byte(0xc4); byte(0x08);
+  byte(0x41); byte(0x5f);
+  byte(0x41); byte(0x5e);
+  byte(0x41); byte(0x5d);
+  byte(0x41); byte(0x5c);
+  byte(0x5d);
+  byte(0x5b);
+  byte(0xc3);
+
+  region.used = out - region.base;
+}
+
+// Code is never writable and executable at once: a range is flipped to RW to emit into it and back to RX after.
+static bool protect(uint8_t* from, uint8_t* to, int prot) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)from & ~(page - 1);
+  uintptr_t end = ((uintptr_t)to + page - 1) & ~(page - 1);
+
+  if (mprotect((void*)start, end - start, prot) == 0) return true;
+
+  fprintf(stderr, "Could not protect JIT code: %s.\n", strerror(errno));
+  return false;
+}
+
+bool init_jit() {
+  if (region.base != NULL) return true;
+
+  void* base = mmap(NULL, JIT_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Could not map JIT code: %s.\n", strerror(errno));
+    return false;
+  }
+
+  region.base = base;
+  emit_stubs();
+
+  if (!protect(region.base, region.base + region.used, PROT_READ | PROT_EXEC)) {
+    munmap(base, JIT_REGION);
+    region.base = NULL;
+    return false;
+  }
+
+  char path[64];
+
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  region.perf_map = fopen(path, "w");
+
+  return true;
+}
+
+void jit_compile(ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+  size_t room = JIT_REGION - region.used;
+
+  // The script runs once, so it is never worth compiling.
+  if (region.base == NULL || function->name == NULL) return;
+  if ((size_t)chunk->count * JIT_MAX_INSTRUCT > room) return;
+
+  uint8_t* start = region.base + region.used;
+
+  if (!protect(start, start + (size_t)chunk->count * JIT_MAX_INSTRUCT, PROT_READ | PROT_WRITE)) return;
+
+  int32_t* at = ALLOCATE(int32_t, chunk->count);
+  Fixup* fixups = ALLOCATE(Fixup, chunk->count * 2);
+  int fixup_count = 0;
+
+  out = start;
+
+  for (int offset = 0; offset < chunk->count; offset += instruct_length(chunk, offset)) {
+    at[offset] = (int32_t)(out - start);
+    emit_instruct(chunk, offset, fixups, &fixup_count);
+  }
+
+  for (int i = 0; i < fixup_count; i++) {
+    patch(fixups[i].at, start + at[fixups[i].target]);
+  }
+
+  FREE_ARRAY(Fixup, fixups, chunk->count * 2);
+
+  // The pages just written can hold the stubs and the native code that called in here,
+  // so there is no running on if they can't be made executable again.
+  if (!protect(start, start + (size_t)chunk->count * JIT_MAX_INSTRUCT, PROT_READ | PROT_EXEC)) exit(1);
+
+  JitCode* jit = ALLOCATE(JitCode, 1);
+
+  jit->code = start;
+  jit->size = out - start;
+  jit->at = at;
+  jit->at_count = chunk->count;
+
+  region.used += jit->size;
+  function->jit = jit;
+
+  if (region.perf_map != NULL) {
+    fprintf(region.perf_map, "%lx %zx nvm:%.*s\n", (unsigned long)(uintptr_t)start, jit->size,
+      function->name->length, function->name->chars);
+    fflush(region.perf_map);
+  }
+}
+
+JitStatus jit_run(CallFrame* frame) {
+  JitCode* jit = frame->closure->function->jit;
+  uint8_t* target = jit->code + jit->at[frame->ip - frame->closure->function->chunk.code];
+
+  return (JitStatus)((JitEntry)region.enter)(frame, frame->slots, vm.stack_top, target);
+}
+
+#else
+
+bool init_jit() {
+  fprintf(stderr, "The JIT is only available on x86-64 Linux.\n");
+  return false;
+}
+
+void jit_compile(ObjFunc* function) {
+}
+
+JitStatus jit_run(CallFrame* frame) {
+  return JIT_STEP;
+}
+
+#endif
+
+// The code itself stays in the region, which is never unmapped.
+void free_jit(JitCode* jit) {
+  FREE_ARRAY(int32_t, jit->at, jit->at_count);
+  FREE(JitCode, jit);
+}
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "include/layout.h"
+#include "include/memory.h"
+#include "include/vm.h"
+
+static uint8_t* code_bytes = NULL;
+static size_t code_size = 0;
+
+typedef struct {
+  int count;
+  int capacity;
+  ObjFunc** functions;
+} FuncList;
+
+// Depth first, leaving out bodies still waiting to be compiled and those already borrowed.
+static void collect(FuncList* list, ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+
+  if (function->lazy != NULL || chunk->capacity == 0) return;
+
+  if (list->count == list->capacity) {
+    int old_capacity = list->capacity;
+
+    list->capacity = GROW_CAPACITY(old_capacity);
+    list->functions = GROW_ARRAY(ObjFunc*, list->functions, old_capacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+
+    if (IS_FUNC(value)) collect(list, AS_FUNC(value));
+    else if (IS_CLOSURE(value)) collect(list, AS_CLOSURE(value)->function);
+  }
+}
+
+static uint8_t* map_code(size_t size) {
+#ifndef _WIN32
+  void* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return bytes == MAP_FAILED ? NULL : bytes;
+#else
+  return malloc(size);
+#endif
+}
+
+void pack_code(ObjFunc* script) {
+  // Only one script is ever run, so one region is enough.
+  if (code_bytes != NULL) return;
+
+  // Growing the list can collect, and nothing else roots the script yet.
+  push(OBJ_VAL(script));
+
+  FuncList list = { 0, 0, NULL };
+
+  collect(&list, script);
+
+  // Every function follows the script, so moving it to the end
+  // leaves the rest in the order they appear in the source.
+  if (list.count > 0 && list.functions[0] == script) {
+    memmove(list.functions, list.functions + 1, sizeof(ObjFunc*) * (list.count - 1));
+    list.functions[list.count - 1] = script;
+  }
+
+  size_t code_end = 0;
+
+  for (int i = 0; i < list.count; i++) code_end += list.functions[i]->chunk.count;
+
+  size_t lines_start = (code_end + _Alignof(LineStart) - 1) & ~(_Alignof(LineStart) - 1);
+  size_t size = lines_start;
+
+  for (int i = 0; i < list.count; i++) size += sizeof(LineStart) * list.functions[i]->chunk.line_count;
+
+  uint8_t* bytes = size > 0 ? map_code(size) : NULL;
+
+  if (bytes != NULL) {
+    uint8_t* code = bytes;
+    LineStart* lines = (LineStart*)(bytes + lines_start);
+
+    for (int i = 0; i < list.count; i++) {
+      Chunk* chunk = &list.functions[i]->chunk;
+
+      memcpy(code, chunk->code, chunk->count);
+      memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->line_count);
+      FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+      FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
+
+      // A capacity of 0 marks the arrays as borrowed.
+      chunk->code = code;
+      chunk->capacity = 0;
+      chunk->lines = lines;
+      chunk->line_capacity = 0;
+
+      code += chunk->count;
+      lines += chunk->line_count;
+    }
+
+#ifndef _WIN32
+    mprotect(bytes, size, PROT_READ);
+#endif
+    code_bytes = bytes;
+    code_size = size;
+  }
+
+  // Constants are never added once compiled, so the slack can go.
+  for (int i = 0; i < list.count; i++) {
+    ValueArray* constants = &list.functions[i]->chunk.constants;
+
+    constants->values = GROW_ARRAY(Value, constants->values, constants->capacity, constants->count);
+    constants->capacity = constants->count;
+  }
+
+  FREE_ARRAY(ObjFunc*, list.functions, list.capacity);
+  pop();
+}
+
+void free_code() {
+  if (code_bytes == NULL) return;
+
+#ifndef _WIN32
+  munmap(code_bytes, code_size);
+#else
+  free(code_bytes);
+#endif
+  code_bytes = NULL;
+  code_size = 0;
+}
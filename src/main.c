@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include "include/common.h"
+#include "include/aot.h"
 #include "include/chunk.h"
 #include "include/debug.h"
+#include "include/cache.h"
+#include "include/compiler.h"
+#include "include/jit.h"
+#include "include/layout.h"
+#include "include/optimize.h"
 #include "include/vm.h"
 
 static void repl() {
@@ -55,27 +61,138 @@ static char* io_read_file(const char* path) {
 	return buffer;
 }
 
-static void io_file_run(const char* path) {
+// `file.nvm` becomes `file` plus `ext`, anything else just gets `ext` added.
+static char* io_out_path(const char* path, const char* ext) {
+	size_t length = strlen(path);
+	char* out_path = (char*)malloc(length + strlen(ext) + 1);
+
+	if (out_path == NULL) {
+		fprintf(stderr, "Not enough memory.\n");
+		exit(74);
+	}
+
+	memcpy(out_path, path, length + 1);
+
+	if (length >= 4 && strcmp(path + length - 4, ".nvm") == 0) {
+		out_path[length - 4] = '\0';
+	}
+	strcat(out_path, ext);
+
+	return out_path;
+}
+
+static void io_emit_c(const char* path) {
 	char* src = io_read_file(path);
-	InterpResult result = interp(src);
+	char* c_path = io_out_path(path, ".c");
+	ObjFunc* function = compile(src);
 
 	free(src);
 
+	if (function == NULL) exit(65);
+
+	if (!emit_c(function, c_path)) {
+		fprintf(stderr, "Could not write `%s`.\n", c_path);
+		exit(74);
+	}
+
+	free(c_path);
+}
+
+static void io_file_run(const char* path, bool compile_only, bool lazy) {
+	char* src = io_read_file(path);
+	char* cache_path = io_out_path(path, ".nvmc");
+	uint64_t src_hash = hash_source(src, strlen(src));
+	bool stale = false;
+	// Lazy runs compile as they go, so they leave the cache alone.
+	ObjFunc* function = compile_only || lazy ? NULL : load_cache(cache_path, src_hash, compile_options(), &stale);
+
+	if (function != NULL || compile_only || !lazy) {
+		if (function == NULL) function = compile(src);
+
+		free(src);
+	}
+	else {
+		// Lazy bodies are compiled from the source as they're called,
+		// so it is kept for as long as the script runs.
+		function = compile_lazy(src);
+	}
+
+	if (function == NULL) exit(65);
+
+	if (compile_only) {
+		if (!write_cache(function, cache_path, src_hash, compile_options())) {
+			fprintf(stderr, "Could not write `%s`.\n", cache_path);
+			exit(74);
+		}
+
+		free(cache_path);
+		return;
+	}
+
+	// A cache that is out of date is brought up to date for next time.
+	// Failing to is no reason not to run.
+	if (stale) write_cache(function, cache_path, src_hash, compile_options());
+
+	free(cache_path);
+	pack_code(function);
+
+	InterpResult result = interp_func(function);
+
 	if (result == INTERP_COMPILE_ERR) exit(65);
 	if (result == INTERP_RUNTIME_ERR) exit(70);
 }
 
 int main(int argc, const char* argv[]) {
+	bool compile_only = false;
+	bool lazy = false;
+	bool jit = false;
+	bool emit = false;
+	int arg = 1;
+
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (strcmp(argv[arg], "--compile") == 0) {
+			compile_only = true;
+		}
+		else if (strcmp(argv[arg], "--lazy") == 0) {
+			lazy = true;
+		}
+		else if (strcmp(argv[arg], "--reg") == 0) {
+			set_reg_mode(true);
+		}
+		else if (strcmp(argv[arg], "--jit") == 0) {
+			jit = true;
+		}
+		else if (strcmp(argv[arg], "--emit-c") == 0) {
+			emit = true;
+		}
+		else if (strncmp(argv[arg], "-O", 2) == 0 && strlen(argv[arg]) == 3 &&
+				argv[arg][2] >= '0' && argv[arg][2] <= '0' + OPT_MAX) {
+			set_opt_level(argv[arg][2] - '0');
+		}
+		else {
+			fprintf(stderr, "Unknown option `%s`.\n", argv[arg]);
+			exit(64);
+		}
+	}
+
 	init_vm();
 
-	if (argc == 1) {
+	if (jit && !init_jit()) {
+		exit(64);
+	}
+	vm.jit = jit;
+
+	if (arg == argc && !compile_only && !emit) {
 		repl();
 	}
-	else if (argc == 2) {
-		io_file_run(argv[1]);
+	else if (arg == argc - 1 && emit) {
+		io_emit_c(argv[arg]);
+	}
+	else if (arg == argc - 1) {
+		io_file_run(argv[arg], compile_only, lazy);
 	}
 	else {
-		fprintf(stderr, "Usage: `nvmbrc [path2file]`\n");
+		fprintf(stderr, "Usage: `nvmbrc [--compile | --emit-c | --lazy | --reg | --jit | -O0 | -O1 | -O2] [path2file]`\n");
 		exit(64);
 	}
 
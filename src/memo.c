@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include "include/memo.h"
+#include "include/memory.h"
+
+Memo* new_memo(int arity, int limit) {
+  Memo* memo = ALLOCATE(Memo, 1);
+
+  memo->arity = arity;
+  memo->limit = limit;
+  memo->count = 0;
+  memo->capacity = 0;
+  memo->entries = NULL;
+  memo->args = NULL;
+  memo->bucket_count = 0;
+  memo->buckets = NULL;
+  memo->newest = -1;
+  memo->oldest = -1;
+  memo->next_id = 0;
+
+  return memo;
+}
+
+void free_memo(Memo* memo) {
+  FREE_ARRAY(MemoEntry, memo->entries, memo->capacity);
+  FREE_ARRAY(Value, memo->args, memo->capacity * memo->arity);
+  FREE_ARRAY(int, memo->buckets, memo->bucket_count);
+  FREE(Memo, memo);
+}
+
+void mark_memo(Memo* memo) {
+  for (int i = 0; i < memo->count; i++) {
+    if (memo->entries[i].done) mark_val(memo->entries[i].result);
+  }
+  for (int i = 0; i < memo->count * memo->arity; i++) {
+    mark_val(memo->args[i]);
+  }
+}
+
+uint32_t hash_args(Value* args, int count) {
+  uint64_t hash = 0x9e3779b97f4a7c15u;
+
+  for (int i = 0; i < count; i++) {
+    hash = (hash ^ value_bits(args[i])) * 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+  }
+
+  return (uint32_t)hash;
+}
+
+static bool args_equ(Memo* memo, int index, Value* args) {
+  Value* keys = &memo->args[index * memo->arity];
+
+  for (int i = 0; i < memo->arity; i++) {
+    if (value_bits(keys[i]) != value_bits(args[i])) return false;
+  }
+  return true;
+}
+
+static void unlink_use(Memo* memo, int index) {
+  MemoEntry* entry = &memo->entries[index];
+
+  if (entry->newer != -1) memo->entries[entry->newer].older = entry->older;
+  else memo->newest = entry->older;
+
+  if (entry->older != -1) memo->entries[entry->older].newer = entry->newer;
+  else memo->oldest = entry->newer;
+}
+
+static void link_newest(Memo* memo, int index) {
+  MemoEntry* entry = &memo->entries[index];
+
+  entry->newer = -1;
+  entry->older = memo->newest;
+
+  if (memo->newest != -1) memo->entries[memo->newest].newer = index;
+  else memo->oldest = index;
+
+  memo->newest = index;
+}
+
+static void unlink_bucket(Memo* memo, int index) {
+  int* link = &memo->buckets[memo->entries[index].hash & (memo->bucket_count - 1)];
+
+  while (*link != index) link = &memo->entries[*link].chain;
+
+  *link = memo->entries[index].chain;
+}
+
+static void grow_memo(Memo* memo) {
+  int capacity = GROW_CAPACITY(memo->capacity);
+
+  if (memo->limit > 0 && capacity > memo->limit) capacity = memo->limit;
+
+  int bucket_count = 8;
+
+  while (bucket_count < capacity * 2) bucket_count *= 2;
+
+  // Entries past `count` aren't marked, so growing is safe to collect in between.
+  memo->entries = GROW_ARRAY(MemoEntry, memo->entries, memo->capacity, capacity);
+  memo->args = GROW_ARRAY(Value, memo->args, memo->capacity * memo->arity, capacity * memo->arity);
+
+  int* buckets = ALLOCATE(int, bucket_count);
+
+  FREE_ARRAY(int, memo->buckets, memo->bucket_count);
+
+  for (int i = 0; i < bucket_count; i++) buckets[i] = -1;
+
+  for (int i = 0; i < memo->count; i++) {
+    int* bucket = &buckets[memo->entries[i].hash & (bucket_count - 1)];
+
+    memo->entries[i].chain = *bucket;
+    *bucket = i;
+  }
+
+  memo->capacity = capacity;
+  memo->buckets = buckets;
+  memo->bucket_count = bucket_count;
+}
+
+bool get_memo(Memo* memo, Value* args, uint32_t hash, Value* result) {
+  if (memo->count == 0) return false;
+
+  int index = memo->buckets[hash & (memo->bucket_count - 1)];
+
+  for (; index != -1; index = memo->entries[index].chain) {
+    MemoEntry* entry = &memo->entries[index];
+
+    if (entry->done && entry->hash == hash && args_equ(memo, index, args)) {
+      if (memo->limit > 0 && memo->newest != index) {
+        unlink_use(memo, index);
+        link_newest(memo, index);
+      }
+
+      *result = entry->result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Makes an entry for a call that is about to run, which
+// set_memo fills in once it returns. Returns its index.
+int add_memo(Memo* memo, Value* args, uint32_t hash) {
+  int index;
+
+  if (memo->limit > 0 && memo->count == memo->limit) {
+    index = memo->oldest;
+
+    unlink_bucket(memo, index);
+    unlink_use(memo, index);
+  }
+  else {
+    if (memo->count == memo->capacity) grow_memo(memo);
+
+    index = memo->count++;
+  }
+
+  MemoEntry* entry = &memo->entries[index];
+  int* bucket = &memo->buckets[hash & (memo->bucket_count - 1)];
+
+  entry->hash = hash;
+  entry->id = ++memo->next_id;
+  entry->done = false;
+  entry->result = NIL_VAL;
+  entry->chain = *bucket;
+  *bucket = index;
+
+  for (int i = 0; i < memo->arity; i++) {
+    memo->args[index * memo->arity + i] = args[i];
+  }
+
+  if (memo->limit > 0) link_newest(memo, index);
+
+  return index;
+}
+
+void set_memo(Memo* memo, int index, uint32_t id, Value result) {
+  MemoEntry* entry = &memo->entries[index];
+
+  if (entry->id != id) return;
+
+  entry->result = result;
+  entry->done = true;
+}
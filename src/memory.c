@@ -2,6 +2,9 @@
 
 #include "include/memory.h"
 #include "include/compiler.h"
+#include "include/jit.h"
+#include "include/memo.h"
+#include "include/optimize.h"
 #include "include/vm.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -90,7 +93,9 @@ static void bobj(Obj* object) {
       ObjClass* klass = (ObjClass*)object;
 
       mark_obj((Obj*)klass->name);
+      mark_obj((Obj*)klass->methods_from);
       mark_table(&klass->methods);
+      mark_obj((Obj*)klass->initializer);
 
       break;
     }
@@ -100,8 +105,9 @@ static void bobj(Obj* object) {
       mark_obj((Obj*)closure->function);
 
       for (int i = 0; i < closure->upval_count; i++) {
-        mark_obj((Obj*)closure->upvals[i]);
+        mark_val(closure->upvals[i]);
       }
+      if (closure->memo != NULL) mark_memo(closure->memo);
       break;
     }
     case OBJ_FUNC: {
@@ -123,8 +129,10 @@ static void bobj(Obj* object) {
     case OBJ_UPVAL:
       mark_val(((ObjUpval*)object)->closed);
       break;
-    case OBJ_NATIVE:
     case OBJ_STRING:
+      mark_obj((Obj*)((ObjString*)object)->owner);
+      break;
+    case OBJ_NATIVE:
       break;
   }
 }
@@ -150,7 +158,8 @@ static void free_obj_s(Obj* object) {
     case OBJ_CLOSURE: {
       ObjClose* closure = (ObjClose*)object;
 
-      FREE_ARRAY(ObjUpval*, closure->upvals, closure->upval_count);
+      FREE_ARRAY(Value, closure->upvals, closure->upval_count);
+      if (closure->memo != NULL) free_memo(closure->memo);
       FREE(ObjClose, object);
 
       break;
@@ -159,6 +168,9 @@ static void free_obj_s(Obj* object) {
       ObjFunc* function = (ObjFunc*)object;
 
       free_chunk(&function->chunk);
+      if (function->lazy != NULL) free_lazy(function->lazy);
+      if (function->jit != NULL) free_jit(function->jit);
+      if (function->live != NULL) free_live(function->live);
       FREE(ObjFunc, object);
 
       break;
@@ -177,23 +189,52 @@ static void free_obj_s(Obj* object) {
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
 
-      FREE_ARRAY(char, string->chars, string->length + 1);
+      if (string->owner == NULL) {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+      }
       FREE(ObjString, object);
 
       break;
     }
-    case OBJ_UPVAL: {
-      printf("upval");
+    case OBJ_UPVAL:
+      FREE(ObjUpval, object);
       break;
+  }
+}
+
+// Marks the slots of a frame up to `end`. Those its code won't read
+// again are cleared instead, so nothing is left pointing at what gets freed.
+static void mark_frame(CallFrame* frame, Value* end) {
+  int height = 0;
+  const uint32_t* live = live_slots(frame->closure->function, frame->ip, &height);
+
+  for (Value* slot = frame->slots; slot < end; slot++) {
+    int index = (int)(slot - frame->slots);
+
+    if (live == NULL || index >= height || (live[index / 32] & (1u << (index % 32)))) {
+      mark_val(*slot);
+    }
+    else {
+      *slot = NIL_VAL;
     }
   }
 }
 
 static void mark_root() {
-  for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-    mark_val(*slot);
+  Value* slot = vm.stack;
+
+  for (int i = 0; i < vm.frame_count; i++) {
+    CallFrame* frame = &vm.frames[i];
+    Value* end = i + 1 < vm.frame_count ? vm.frames[i + 1].slots : vm.stack_top;
+
+    for (; slot < frame->slots; slot++) mark_val(*slot);
+
+    mark_frame(frame, end);
+    slot = end;
   }
 
+  for (; slot < vm.stack_top; slot++) mark_val(*slot);
+
   for (int i = 0; i < vm.frame_count; i++) {
     mark_obj((Obj*)vm.frames[i].closure);
   }
@@ -205,6 +246,7 @@ static void mark_root() {
   mark_table(&vm.globals);
   mark_compiler_root();
   mark_obj((Obj*)vm.init_string);
+  mark_obj((Obj*)vm.pair_class);
 }
 
 static void trace_refs() {
@@ -248,7 +290,7 @@ void garbage_collect() {
 
   mark_root();
   trace_refs();
-  table_rmwhi(&vm.strings);
+  strset_rmwhi(&vm.strings);
   sweep();
 
   vm.next_gc = vm.alloced_bytes * GC_HEAP_GROW_FACTOR;
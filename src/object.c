@@ -5,6 +5,7 @@
 #include "include/value.h"
 #include "include/vm.h"
 #include "include/table.h"
+#include "include/strset.h"
 
 #define ALLOCATE_OBJ(type, object_type) \
   (type*)allocate_obj(sizeof(type), object_type)
@@ -39,22 +40,25 @@ ObjClass* new_class(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 
   klass->name = name;
+  klass->methods_from = klass;
   init_table(&klass->methods);
+  klass->initializer = NULL;
 
   return klass;
 }
 
 ObjClose* new_close(ObjFunc* function) {
-  ObjUpval** upvals = ALLOCATE(ObjUpval*, function->upval_count);
+  Value* upvals = ALLOCATE(Value, function->upval_count);
 
   for (int i = 0; i < function->upval_count; i++) {
-    upvals[i] = NULL;
+    upvals[i] = NIL_VAL;
   }
 
   ObjClose* closure = ALLOCATE_OBJ(ObjClose, OBJ_CLOSURE);
   closure->function = function;
   closure->upvals = upvals;
   closure->upval_count = function->upval_count;
+  closure->memo = NULL;
 
   return closure;
 }
@@ -65,6 +69,16 @@ ObjFunc* new_func() {
   function->arity = 0;
   function->upval_count = 0;
   function->name = NULL;
+  function->lazy = NULL;
+  function->trivial = TRIVIAL_NONE;
+  function->trivial_slot = 0;
+  function->trivial_value = NIL_VAL;
+  function->jit = NULL;
+  function->calls = 0;
+  function->aot = NULL;
+  function->fast_entry = 0;
+  function->max_stack = 0;
+  function->live = NULL;
   init_chunk(&function->chunk);
 
   return function;
@@ -94,9 +108,10 @@ static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->owner = NULL;
 
   push(OBJ_VAL(string));
-  set_table(&vm.strings, string, NIL_VAL);
+  strset_add(&vm.strings, string);
   pop();
 
   return string;
@@ -115,7 +130,7 @@ static uint32_t hash_string(const char* key, int length) {
 
 ObjString* take_string(char* chars, int length) {
   uint32_t hash = hash_string(chars, length);
-  ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+  ObjString* interned = strset_find(&vm.strings, chars, length, hash);
 
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
@@ -127,7 +142,7 @@ ObjString* take_string(char* chars, int length) {
 
 ObjString* copy_string(const char* chars, int length) {
   uint32_t hash = hash_string(chars, length);
-  ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+  ObjString* interned = strset_find(&vm.strings, chars, length, hash);
 
   if (interned != NULL) return interned;
 
@@ -138,6 +153,27 @@ ObjString* copy_string(const char* chars, int length) {
   return allocate_string(heap_chars, length, hash);
 }
 
+ObjString* slice_string(ObjString* string, int start, int length) {
+  if (start == 0 && length == string->length) return string;
+
+  const char* chars = string->chars + start;
+  uint32_t hash = hash_string(chars, length);
+  ObjString* interned = strset_find(&vm.strings, chars, length, hash);
+
+  if (interned != NULL) return interned;
+
+  ObjString* owner = string->owner != NULL ? string->owner : string;
+
+  push(OBJ_VAL(owner));
+
+  ObjString* slice = allocate_string((char*)chars, length, hash);
+  slice->owner = owner;
+
+  pop();
+
+  return slice;
+}
+
 ObjUpval* new_upval(Value* slot) {
   ObjUpval* upval = ALLOCATE_OBJ(ObjUpval, OBJ_UPVAL);
 
@@ -153,7 +189,7 @@ static void print_func(ObjFunc* function) {
     printf("<script>");
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  printf("<fn %.*s>", function->name->length, function->name->chars);
 }
 
 void print_obj(Value value) {
@@ -162,7 +198,7 @@ void print_obj(Value value) {
       print_func(AS_BOUND_METHOD(value)->method->function);
       break;
     case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      printf("%.*s", AS_CLASS(value)->name->length, AS_CLASS(value)->name->chars);
       break;
     case OBJ_CLOSURE:
       print_func(AS_CLOSURE(value)->function);
@@ -171,13 +207,13 @@ void print_obj(Value value) {
       print_func(AS_FUNC(value));
       break;
     case OBJ_INST:
-      printf("%s instance", AS_INST(value)->klass->name->chars);
+      printf("%.*s instance", AS_INST(value)->klass->name->length, AS_INST(value)->klass->name->chars);
       break;
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
       break;
     case OBJ_UPVAL:
       printf("upval");
@@ -0,0 +1,1351 @@
+#include <stdlib.h>
+#include "include/optimize.h"
+#include "include/memory.h"
+#include "include/object.h"
+
+// One decoded instruction, kept by its place in the old code.
+typedef struct {
+  int offset;
+  int length;
+  uint8_t op;
+  bool wide;
+  bool live;
+  int target;
+  int first_case;
+  int line;
+  // Set once to_registers has rewritten the instruction into `bytes`.
+  bool rewritten;
+  uint8_t bytes[3];
+} Instr;
+
+// A run of instructions that is only entered at the top.
+typedef struct {
+  int first;
+  int last;
+  int next;
+  int jump;
+  bool reachable;
+} Block;
+
+typedef struct {
+  Chunk* chunk;
+  int count;
+  Instr* instrs;
+  int case_count;
+  int* cases;
+  bool* targeted;
+  int block_count;
+  Block* blocks;
+  int* block_of;
+} Graph;
+
+static bool is_jump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE;
+}
+
+static bool is_switch(uint8_t op) {
+  return op == OP_SWITCH_RANGE || op == OP_SWITCH_HASH;
+}
+
+static int read_short(uint8_t* code) {
+  return (code[0] << 8) | code[1];
+}
+
+// A switch holds a jump for its default and then one per slot.
+static int switch_jumps(Chunk* chunk, Instr* instr) {
+  return 1 + read_short(&chunk->code[instr->offset + (instr->op == OP_SWITCH_RANGE ? 3 : 1)]);
+}
+
+// Where the jump `index` of a switch sits, from its start.
+static int switch_jump_at(Instr* instr, int index) {
+  if (instr->op == OP_SWITCH_RANGE) return index == 0 ? 5 : 7 + 2 * (index - 1);
+
+  return index == 0 ? 3 : 7 + 4 * (index - 1);
+}
+
+static int read_jump(Chunk* chunk, Instr* instr) {
+  uint8_t* code = &chunk->code[instr->offset];
+
+  if (instr->wide) return instr->offset + 5 + (code[2] | (code[3] << 8) | (code[4] << 16));
+
+  return instr->offset + 3 + ((code[1] << 8) | code[2]);
+}
+
+// Decodes the chunk, failing on jumps that don't land on an instruction.
+static bool decode(Graph* graph, Chunk* chunk) {
+  int count = 0;
+  int case_count = 0;
+
+  for (int offset = 0; offset < chunk->count; count++) {
+    if (is_switch(chunk->code[offset])) {
+      Instr instr = { .offset = offset, .op = chunk->code[offset] };
+
+      case_count += switch_jumps(chunk, &instr);
+    }
+
+    offset += instruct_length(chunk, offset);
+  }
+
+  graph->chunk = chunk;
+  graph->count = count;
+  graph->instrs = ALLOCATE(Instr, count);
+  graph->case_count = case_count;
+  graph->cases = ALLOCATE(int, case_count);
+  graph->targeted = ALLOCATE(bool, count);
+  graph->blocks = ALLOCATE(Block, count);
+  graph->block_of = ALLOCATE(int, count);
+  graph->block_count = 0;
+
+  int* at = ALLOCATE(int, chunk->count + 1);
+
+  for (int i = 0; i <= chunk->count; i++) at[i] = -1;
+
+  for (int i = 0, offset = 0; i < count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    instr->offset = offset;
+    instr->length = instruct_length(chunk, offset);
+    instr->wide = chunk->code[offset] == OP_WIDE;
+    instr->op = chunk->code[offset + instr->wide];
+    instr->live = true;
+    instr->target = -1;
+    instr->line = get_line(chunk, offset);
+    instr->rewritten = false;
+
+    at[offset] = i;
+    offset += instr->length;
+  }
+
+  bool ok = true;
+  int next_case = 0;
+
+  for (int i = 0; i < count && ok; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (is_switch(instr->op)) {
+      instr->first_case = next_case;
+
+      for (int c = 0; c < switch_jumps(chunk, instr) && ok; c++) {
+        int end = instr->offset + instr->length;
+        int target = end + read_short(&chunk->code[instr->offset + switch_jump_at(instr, c)]);
+
+        if (target >= chunk->count || at[target] == -1) ok = false;
+        else graph->cases[next_case++] = at[target];
+      }
+    }
+
+    if (!is_jump(instr->op)) continue;
+
+    int target = read_jump(chunk, instr);
+
+    if (target <= instr->offset || target >= chunk->count || at[target] == -1) ok = false;
+    else instr->target = at[target];
+  }
+
+  FREE_ARRAY(int, at, chunk->count + 1);
+  return ok;
+}
+
+static void free_graph(Graph* graph) {
+  FREE_ARRAY(Instr, graph->instrs, graph->count);
+  FREE_ARRAY(int, graph->cases, graph->case_count);
+  FREE_ARRAY(bool, graph->targeted, graph->count);
+  FREE_ARRAY(Block, graph->blocks, graph->count);
+  FREE_ARRAY(int, graph->block_of, graph->count);
+}
+
+static int next_live(Graph* graph, int i) {
+  while (i < graph->count && !graph->instrs[i].live) i++;
+
+  return i;
+}
+
+static int prev_live(Graph* graph, int i) {
+  do i--; while (i >= 0 && !graph->instrs[i].live);
+
+  return i;
+}
+
+// Code removed from under a jump leaves it landing on whatever comes next.
+static int land(Graph* graph, Instr* instr) {
+  return next_live(graph, instr->target);
+}
+
+static int case_count(Graph* graph, Instr* instr) {
+  return is_switch(instr->op) ? switch_jumps(graph->chunk, instr) : 0;
+}
+
+static void find_targets(Graph* graph) {
+  for (int i = 0; i < graph->count; i++) graph->targeted[i] = false;
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (!instr->live) continue;
+
+    if (instr->target != -1) {
+      instr->target = land(graph, instr);
+      graph->targeted[instr->target] = true;
+    }
+
+    for (int c = 0; c < case_count(graph, instr); c++) {
+      int* target = &graph->cases[instr->first_case + c];
+
+      *target = next_live(graph, *target);
+      graph->targeted[*target] = true;
+    }
+  }
+}
+
+static bool ends_block(uint8_t op) {
+  return is_jump(op) || is_switch(op) || op == OP_RETURN;
+}
+
+// Splits the live code into blocks and links each to where it can go next.
+static void build_blocks(Graph* graph) {
+  find_targets(graph);
+  graph->block_count = 0;
+
+  Block* block = NULL;
+
+  for (int i = next_live(graph, 0); i < graph->count; i = next_live(graph, i + 1)) {
+    if (block == NULL || graph->targeted[i] || ends_block(graph->instrs[block->last].op)) {
+      block = &graph->blocks[graph->block_count++];
+      block->first = i;
+      block->reachable = false;
+    }
+
+    block->last = i;
+    graph->block_of[i] = graph->block_count - 1;
+  }
+
+  for (int b = 0; b < graph->block_count; b++) {
+    block = &graph->blocks[b];
+    Instr* last = &graph->instrs[block->last];
+
+    block->next = last->op == OP_JUMP || last->op == OP_RETURN || is_switch(last->op) ||
+      b + 1 == graph->block_count ? -1 : b + 1;
+    block->jump = is_jump(last->op) ? graph->block_of[last->target] : -1;
+  }
+}
+
+// Follows a jump through the jumps it lands on. A jump-if-false that lands on another
+// is taken there too, since the value it tested is still on the stack.
+static bool thread_jumps(Graph* graph) {
+  bool changed = false;
+
+  find_targets(graph);
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (!instr->live) continue;
+
+    for (int c = 0; c < case_count(graph, instr); c++) {
+      int* target = &graph->cases[instr->first_case + c];
+
+      while (graph->instrs[*target].op == OP_JUMP) {
+        *target = land(graph, &graph->instrs[*target]);
+        changed = true;
+      }
+    }
+
+    if (!is_jump(instr->op)) continue;
+
+    for (int hops = 0; hops < graph->count; hops++) {
+      Instr* target = &graph->instrs[instr->target];
+
+      if (target->op != OP_JUMP && target->op != instr->op) break;
+
+      instr->target = land(graph, target);
+      changed = true;
+    }
+
+    if (instr->op == OP_JUMP && instr->target == next_live(graph, i + 1)) {
+      instr->live = false;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Drops blocks nothing reaches, which covers the code after a `return`.
+static bool drop_unreachable(Graph* graph) {
+  build_blocks(graph);
+
+  if (graph->block_count == 0) return false;
+
+  int* work = ALLOCATE(int, graph->block_count);
+  int work_count = 0;
+
+  graph->blocks[0].reachable = true;
+  work[work_count++] = 0;
+
+  while (work_count > 0) {
+    Block* block = &graph->blocks[work[--work_count]];
+    Instr* last = &graph->instrs[block->last];
+    int succ_count = 2 + case_count(graph, last);
+
+    for (int s = 0; s < succ_count; s++) {
+      int succ = s == 0 ? block->next : s == 1 ? block->jump :
+        graph->block_of[graph->cases[last->first_case + s - 2]];
+
+      if (succ == -1 || graph->blocks[succ].reachable) continue;
+
+      graph->blocks[succ].reachable = true;
+      work[work_count++] = succ;
+    }
+  }
+
+  FREE_ARRAY(int, work, graph->block_count);
+
+  bool changed = false;
+
+  for (int b = 0; b < graph->block_count; b++) {
+    Block* block = &graph->blocks[b];
+
+    if (block->reachable) continue;
+
+    for (int i = block->first; i <= block->last; i++) graph->instrs[i].live = false;
+    changed = true;
+  }
+
+  return changed;
+}
+
+// Pushes with no effect besides the value pushed.
+static bool is_pure_push(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVAL:
+    case OP_GET_FLAT:
+    case OP_DUP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool drop_push_pop(Graph* graph) {
+  bool changed = false;
+
+  find_targets(graph);
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (!instr->live || instr->op != OP_POP || graph->targeted[i]) continue;
+
+    int push = prev_live(graph, i);
+
+    if (push < 0 || !is_pure_push(graph->instrs[push].op)) continue;
+
+    graph->instrs[push].live = false;
+    instr->live = false;
+    changed = true;
+  }
+
+  return changed;
+}
+
+// The truth of what a constant push leaves on the stack: 1, 0 or -1 if unknown.
+static int push_truth(Graph* graph, Instr* instr) {
+  Chunk* chunk = graph->chunk;
+  uint8_t* code = &chunk->code[instr->offset];
+  Value value;
+
+  switch (instr->op) {
+    case OP_NIL:
+    case OP_FALSE: return 0;
+    case OP_TRUE: return 1;
+    case OP_CONSTANT:
+      value = chunk->constants.values[instr->wide ? code[2] | (code[3] << 8) | (code[4] << 16) : code[1]];
+      break;
+    case OP_CONSTANT_LONG:
+      value = chunk->constants.values[code[1] | (code[2] << 8) | (code[3] << 16)];
+      break;
+    default: return -1;
+  }
+
+  return !(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+}
+
+// A jump-if-false straight after a constant always goes the same way.
+static bool fold_branches(Graph* graph) {
+  bool changed = false;
+
+  find_targets(graph);
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (!instr->live || instr->op != OP_JUMP_IF_FALSE || graph->targeted[i]) continue;
+
+    int push = prev_live(graph, i);
+    int truth = push < 0 ? -1 : push_truth(graph, &graph->instrs[push]);
+
+    if (truth == 1) instr->live = false;
+    else if (truth == 0) instr->op = OP_JUMP;
+    else continue;
+
+    changed = true;
+  }
+
+  return changed;
+}
+
+// Writes the live code back, failing if a jump no longer fits its operand.
+static bool emit(Graph* graph) {
+  Chunk* chunk = graph->chunk;
+  int* offsets = ALLOCATE(int, graph->count + 1);
+  int offset = 0;
+
+  for (int i = 0; i < graph->count; i++) {
+    offsets[i] = offset;
+    if (graph->instrs[i].live) offset += graph->instrs[i].length;
+  }
+  offsets[graph->count] = offset;
+
+  Chunk out;
+  bool ok = true;
+
+  init_chunk(&out);
+
+  for (int i = 0; i < graph->count && ok; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (!instr->live) continue;
+
+    if (!is_jump(instr->op)) {
+      int start = out.count;
+
+      for (int b = 0; b < instr->length; b++) {
+        write_chunk(&out, instr->rewritten ? instr->bytes[b] : chunk->code[instr->offset + b], instr->line);
+      }
+
+      for (int c = 0; c < case_count(graph, instr); c++) {
+        int jump = offsets[next_live(graph, graph->cases[instr->first_case + c])] - (offsets[i] + instr->length);
+        uint8_t* field = &out.code[start + switch_jump_at(instr, c)];
+
+        if (jump > UINT16_MAX) ok = false;
+
+        field[0] = (jump >> 8) & 0xff;
+        field[1] = jump & 0xff;
+      }
+      continue;
+    }
+
+    int jump = offsets[land(graph, instr)] - (offsets[i] + instr->length);
+
+    if (instr->wide) {
+      write_chunk(&out, OP_WIDE, instr->line);
+      write_chunk(&out, instr->op, instr->line);
+      write_chunk(&out, jump & 0xff, instr->line);
+      write_chunk(&out, (jump >> 8) & 0xff, instr->line);
+      write_chunk(&out, (jump >> 16) & 0xff, instr->line);
+    }
+    else if (jump <= UINT16_MAX) {
+      write_chunk(&out, instr->op, instr->line);
+      write_chunk(&out, (jump >> 8) & 0xff, instr->line);
+      write_chunk(&out, jump & 0xff, instr->line);
+    }
+    else {
+      ok = false;
+    }
+  }
+
+  FREE_ARRAY(int, offsets, graph->count + 1);
+
+  if (!ok) {
+    free_chunk(&out);
+    return false;
+  }
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity);
+
+  chunk->count = out.count;
+  chunk->capacity = out.capacity;
+  chunk->code = out.code;
+  chunk->line_count = out.line_count;
+  chunk->line_capacity = out.line_capacity;
+  chunk->lines = out.lines;
+  return true;
+}
+
+void optimize_chunk(Chunk* chunk, int level) {
+  if (level <= 0 || chunk->count == 0) return;
+
+  Graph graph;
+
+  if (!decode(&graph, chunk)) {
+    free_graph(&graph);
+    return;
+  }
+
+  // Each pass opens up work for the others, so they go round until nothing changes.
+  for (bool changed = true; changed;) {
+    changed = thread_jumps(&graph);
+
+    if (level >= 2) {
+      changed |= fold_branches(&graph);
+      changed |= drop_push_pop(&graph);
+    }
+
+    changed |= drop_unreachable(&graph);
+  }
+
+  emit(&graph);
+  free_graph(&graph);
+}
+
+// The register form of a binary op, or OP_WIDE if it has none.
+static uint8_t reg_form(uint8_t op, bool constant) {
+  switch (op) {
+    case OP_ADD:     return constant ? OP_ADD_RK : OP_ADD_RR;
+    case OP_SUB:     return constant ? OP_SUB_RK : OP_SUB_RR;
+    case OP_MUL:     return constant ? OP_MUL_RK : OP_MUL_RR;
+    case OP_DIV:     return constant ? OP_DIV_RK : OP_DIV_RR;
+    case OP_LESS:    return constant ? OP_LESS_RK : OP_LESS_RR;
+    case OP_GREATER: return constant ? OP_GREATER_RK : OP_GREATER_RR;
+    case OP_EQU:     return constant ? OP_EQU_RK : OP_EQU_RR;
+    default:         return OP_WIDE;
+  }
+}
+
+// Whether `i` is a narrow `op` that nothing jumps into the middle of a run at.
+static bool fusable(Graph* graph, int i, uint8_t op, bool first) {
+  if (i >= graph->count) return false;
+
+  Instr* instr = &graph->instrs[i];
+
+  return instr->op == op && !instr->wide && !instr->rewritten && (first || !graph->targeted[i]);
+}
+
+static void rewrite(Graph* graph, int i, uint8_t op, int a, int b, int length) {
+  Instr* instr = &graph->instrs[i];
+
+  instr->op = op;
+  instr->length = length;
+  instr->rewritten = true;
+  instr->bytes[0] = op;
+  instr->bytes[1] = (uint8_t)a;
+  instr->bytes[2] = (uint8_t)b;
+}
+
+static int operand(Graph* graph, int i) {
+  return graph->chunk->code[graph->instrs[i].offset + 1];
+}
+
+/*
+  Rewrites runs of stack code into register forms that name
+  frame slots and constants as operands, so that `a + 1`
+  or `x <- y.` is one dispatch instead of three or four. The
+  value a binary op pushes lands in the slot of the next
+  temporary, so the stack top is the destination register.
+*/
+void to_registers(Chunk* chunk) {
+  if (chunk->count == 0) return;
+
+  Graph graph;
+
+  if (!decode(&graph, chunk)) {
+    free_graph(&graph);
+    return;
+  }
+
+  find_targets(&graph);
+
+  for (int i = 0; i < graph.count; i = next_live(&graph, i + 1)) {
+    int j = next_live(&graph, i + 1);
+    int k = j < graph.count ? next_live(&graph, j + 1) : graph.count;
+    bool local = fusable(&graph, i, OP_GET_LOCAL, true);
+    bool constant = fusable(&graph, i, OP_CONSTANT, true);
+
+    if ((local || constant) && fusable(&graph, j, OP_SET_LOCAL, false) && fusable(&graph, k, OP_POP, false)) {
+      rewrite(&graph, i, local ? OP_MOVE : OP_LOADK, operand(&graph, j), operand(&graph, i), 3);
+      graph.instrs[j].live = false;
+      graph.instrs[k].live = false;
+    }
+    else if (local && k < graph.count && !graph.targeted[k] &&
+        (fusable(&graph, j, OP_GET_LOCAL, false) || fusable(&graph, j, OP_CONSTANT, false)) &&
+        reg_form(graph.instrs[k].op, graph.instrs[j].op == OP_CONSTANT) != OP_WIDE) {
+      uint8_t op = reg_form(graph.instrs[k].op, graph.instrs[j].op == OP_CONSTANT);
+
+      rewrite(&graph, i, op, operand(&graph, i), operand(&graph, j), 3);
+      graph.instrs[j].live = false;
+      graph.instrs[k].live = false;
+    }
+    else if (fusable(&graph, i, OP_SET_LOCAL, true) && fusable(&graph, j, OP_POP, false)) {
+      rewrite(&graph, i, OP_STORE, operand(&graph, i), 0, 2);
+      graph.instrs[j].live = false;
+    }
+  }
+
+  emit(&graph);
+  free_graph(&graph);
+}
+
+static bool code_is(Chunk* chunk, const uint8_t* code, int length) {
+  if (chunk->count < length) return false;
+
+  for (int i = 0; i < length; i++) {
+    if (code[i] != 0xff && chunk->code[i] != code[i]) return false;
+  }
+
+  return true;
+}
+
+// Spots bodies that only return a constant, a local or a field of `this`, or
+// only set a field. Anything after their first return can't run, so it's ignored.
+void find_trivial(ObjFunc* function) {
+  static const uint8_t getter[] = { OP_GET_LOCAL, 0, OP_GET_PROP, 0xff, OP_RETURN };
+  static const uint8_t setter[] = { OP_GET_LOCAL, 0, OP_GET_LOCAL, 1, OP_SET_PROP, 0xff, OP_POP, OP_NIL, OP_RETURN };
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code;
+
+  function->trivial = TRIVIAL_NONE;
+
+  // The script always gets a frame, for run() to start in.
+  if (function->name == NULL || chunk->count < 2) return;
+
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      if (code[1] != OP_RETURN) return;
+
+      function->trivial = TRIVIAL_CONST;
+      function->trivial_value = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+      return;
+    case OP_CONSTANT:
+      if (chunk->count < 3 || code[2] != OP_RETURN || code[1] >= chunk->constants.count) return;
+
+      function->trivial = TRIVIAL_CONST;
+      function->trivial_value = chunk->constants.values[code[1]];
+      return;
+    case OP_GET_LOCAL:
+      if (chunk->count >= 3 && code[2] == OP_RETURN && code[1] <= function->arity) {
+        function->trivial = TRIVIAL_LOCAL;
+        function->trivial_slot = code[1];
+      }
+      else if (code_is(chunk, getter, sizeof(getter)) && code[3] < chunk->constants.count) {
+        function->trivial = TRIVIAL_GETTER;
+        function->trivial_value = chunk->constants.values[code[3]];
+      }
+      else if (function->arity == 1 && code_is(chunk, setter, sizeof(setter)) &&
+          code[5] < chunk->constants.count) {
+        function->trivial = TRIVIAL_SETTER;
+        function->trivial_value = chunk->constants.values[code[5]];
+      }
+      return;
+    default:
+      return;
+  }
+}
+
+// What a value is known to be.
+typedef enum {
+  KIND_ANY,
+  KIND_NUM,
+  KIND_BOOL,
+} Kind;
+
+// Deeper stacks, and wide slots, are rare enough to leave alone.
+#define KIND_SLOTS UINT8_COUNT
+
+typedef struct {
+  // -1 where the code can't be reached.
+  int depth;
+  uint8_t kinds[KIND_SLOTS];
+} KindState;
+
+typedef struct {
+  Graph* graph;
+  ObjFunc* function;
+  // Slots a closure captures, which a call can change behind our back.
+  bool captured[KIND_SLOTS];
+  // The state at each jump target, once something jumps there.
+  KindState** at;
+} Kinds;
+
+static uint8_t num_form(uint8_t op) {
+  switch (op) {
+    case OP_ADD:     return OP_ADD_NUM;
+    case OP_SUB:     return OP_SUB_NUM;
+    case OP_MUL:     return OP_MUL_NUM;
+    case OP_DIV:     return OP_DIV_NUM;
+    case OP_LESS:    return OP_LESS_NUM;
+    case OP_GREATER: return OP_GREATER_NUM;
+    case OP_EQU:     return OP_EQU_NUM;
+    case OP_NEGATE:  return OP_NEGATE_NUM;
+    default:         return OP_WIDE;
+  }
+}
+
+// The stack op behind a register form.
+static uint8_t stack_form(uint8_t op) {
+  switch (op) {
+    case OP_ADD_RR: case OP_ADD_RK: return OP_ADD;
+    case OP_SUB_RR: case OP_SUB_RK: return OP_SUB;
+    case OP_MUL_RR: case OP_MUL_RK: return OP_MUL;
+    case OP_DIV_RR: case OP_DIV_RK: return OP_DIV;
+    case OP_LESS_RR: case OP_LESS_RK: return OP_LESS;
+    case OP_GREATER_RR: case OP_GREATER_RK: return OP_GREATER;
+    default: return OP_EQU;
+  }
+}
+
+static int first_operand(Chunk* chunk, Instr* instr) {
+  uint8_t* code = &chunk->code[instr->offset];
+
+  if (instr->wide) return code[2] | (code[3] << 8) | (code[4] << 16);
+  if (instr->op == OP_CONSTANT_LONG) return code[1] | (code[2] << 8) | (code[3] << 16);
+
+  return code[1];
+}
+
+static uint8_t const_kind(Chunk* chunk, int index) {
+  Value value = chunk->constants.values[index];
+
+  return IS_NUM(value) ? KIND_NUM : IS_BOOL(value) ? KIND_BOOL : KIND_ANY;
+}
+
+static uint8_t slot_kind(Kinds* kinds, KindState* state, int slot) {
+  return kinds->captured[slot] ? KIND_ANY : state->kinds[slot];
+}
+
+// What a binary op leaves, given what its operands are. Arithmetic on
+// anything but numbers is an error, unless both sides are strings.
+static uint8_t result_kind(uint8_t op, uint8_t a, uint8_t b) {
+  switch (op) {
+    case OP_ADD:
+      return a == KIND_NUM || b == KIND_NUM ? KIND_NUM : KIND_ANY;
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_EQU:
+      return KIND_BOOL;
+    default:
+      return KIND_NUM;
+  }
+}
+
+static bool find_captured(Kinds* kinds) {
+  Graph* graph = kinds->graph;
+  Chunk* chunk = graph->chunk;
+
+  for (int i = 0; i < KIND_SLOTS; i++) kinds->captured[i] = false;
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (instr->op != OP_CLOSURE) continue;
+
+    int width = instr->wide ? 3 : 1;
+    ObjFunc* inner = AS_FUNC(chunk->constants.values[first_operand(chunk, instr)]);
+    uint8_t* pair = &chunk->code[instr->offset + instr->wide + 1 + width];
+
+    for (int u = 0; u < inner->upval_count; u++, pair += 1 + width) {
+      int index = instr->wide ? pair[1] | (pair[2] << 8) | (pair[3] << 16) : pair[1];
+
+      if (pair[0] != CAPTURE_LOCAL) continue;
+      if (index >= KIND_SLOTS) return false;
+
+      kinds->captured[index] = true;
+    }
+  }
+  return true;
+}
+
+// Merges `state` into what is known where it jumps to.
+static bool join(Kinds* kinds, int target, KindState* state) {
+  KindState* at = kinds->at[target];
+
+  if (at == NULL) {
+    at = kinds->at[target] = ALLOCATE(KindState, 1);
+    *at = *state;
+    return true;
+  }
+
+  if (at->depth != state->depth) return false;
+
+  for (int i = 0; i < state->depth; i++) {
+    if (at->kinds[i] != state->kinds[i]) at->kinds[i] = KIND_ANY;
+  }
+  return true;
+}
+
+// Follows one instruction, marking it in `fast` if its operands are sure to be numbers.
+static bool step_kinds(Kinds* kinds, int i, KindState* state, bool* fast) {
+  Chunk* chunk = kinds->graph->chunk;
+  Instr* instr = &kinds->graph->instrs[i];
+  uint8_t* k = state->kinds;
+  int d = state->depth;
+  int a = instr->op == OP_SWITCH_RANGE || instr->op == OP_SWITCH_HASH || instr->length == 1
+    ? 0 : first_operand(chunk, instr);
+  int b = instr->length == 3 && !instr->wide ? chunk->code[instr->offset + 2] : 0;
+
+  switch (instr->op) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_STORE:
+    case OP_MOVE:
+    case OP_LOADK:
+      if (a >= KIND_SLOTS || (instr->op == OP_MOVE && b >= KIND_SLOTS)) return false;
+      break;
+    default:
+      if (instr->op >= OP_ADD_RR && instr->op <= OP_EQU_RK && (a >= KIND_SLOTS || b >= KIND_SLOTS)) {
+        return false;
+      }
+      break;
+  }
+
+  if (d + 1 > KIND_SLOTS) return false;
+
+  switch (instr->op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      k[d++] = const_kind(chunk, a);
+      break;
+    case OP_TRUE:
+    case OP_FALSE:
+      k[d++] = KIND_BOOL;
+      break;
+    case OP_GET_LOCAL:
+      k[d] = slot_kind(kinds, state, a);
+      d++;
+      break;
+    case OP_SET_LOCAL:
+      k[a] = k[d - 1];
+      break;
+    case OP_STORE:
+      k[a] = k[--d];
+      break;
+    case OP_MOVE:
+      k[a] = slot_kind(kinds, state, b);
+      break;
+    case OP_LOADK:
+      k[a] = const_kind(chunk, b);
+      break;
+    case OP_DUP:
+      k[d] = k[d - 1];
+      d++;
+      break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_EQU:
+      fast[i] = k[d - 2] == KIND_NUM && k[d - 1] == KIND_NUM;
+      k[d - 2] = result_kind(instr->op, k[d - 2], k[d - 1]);
+      d--;
+      break;
+    case OP_NEGATE:
+      fast[i] = k[d - 1] == KIND_NUM;
+      k[d - 1] = KIND_NUM;
+      break;
+    case OP_NOT:
+      k[d - 1] = KIND_BOOL;
+      break;
+    case OP_POP:
+    case OP_CLOSE_UPVAL:
+    case OP_PRINT:
+    case OP_DEF_GLOBAL:
+      d--;
+      break;
+    case OP_SET_PROP:
+      k[d - 2] = k[d - 1];
+      d--;
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_SWITCH_RANGE:
+    case OP_SWITCH_HASH:
+      break;
+    case OP_ADD_RR:
+    case OP_SUB_RR:
+    case OP_MUL_RR:
+    case OP_DIV_RR:
+    case OP_LESS_RR:
+    case OP_GREATER_RR:
+    case OP_EQU_RR:
+      k[d] = result_kind(stack_form(instr->op), slot_kind(kinds, state, a), slot_kind(kinds, state, b));
+      d++;
+      break;
+    case OP_ADD_RK:
+    case OP_SUB_RK:
+    case OP_MUL_RK:
+    case OP_DIV_RK:
+    case OP_LESS_RK:
+    case OP_GREATER_RK:
+    case OP_EQU_RK:
+      k[d] = result_kind(stack_form(instr->op), slot_kind(kinds, state, a), const_kind(chunk, b));
+      d++;
+      break;
+    default:
+      // Whatever else is pushed or left on top is unknown.
+      d += stack_effect(chunk, instr->offset);
+
+      if (d < 0) return false;
+      if (d > 0) k[d - 1] = KIND_ANY;
+
+      break;
+  }
+
+  state->depth = d;
+  return true;
+}
+
+// Marks in `fast` the ops whose operands are sure to be numbers, assuming
+// the parameters are if `num_params`. Fails on code it can't follow.
+static bool find_numbers(Kinds* kinds, bool num_params, bool* fast) {
+  Graph* graph = kinds->graph;
+  ObjFunc* function = kinds->function;
+  KindState state;
+
+  if (function->arity + 1 > KIND_SLOTS) return false;
+
+  state.depth = function->arity + 1;
+  state.kinds[0] = KIND_ANY;
+
+  for (int i = 1; i <= function->arity; i++) state.kinds[i] = num_params ? KIND_NUM : KIND_ANY;
+
+  for (int i = 0; i < graph->count; i++) kinds->at[i] = NULL;
+
+  bool ok = true;
+
+  for (int i = 0; i < graph->count && ok; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    fast[i] = false;
+
+    if (kinds->at[i] != NULL) {
+      if (state.depth != -1 && !join(kinds, i, &state)) {
+        ok = false;
+        break;
+      }
+      state = *kinds->at[i];
+    }
+
+    if (state.depth == -1) continue;
+
+    ok = step_kinds(kinds, i, &state, fast);
+
+    if (ok && instr->target != -1) ok = join(kinds, instr->target, &state);
+
+    for (int c = 0; ok && c < case_count(graph, instr); c++) {
+      ok = join(kinds, graph->cases[instr->first_case + c], &state);
+    }
+
+    if (instr->op == OP_JUMP || instr->op == OP_RETURN || is_switch(instr->op)) state.depth = -1;
+  }
+
+  for (int i = 0; i < graph->count; i++) {
+    if (kinds->at[i] != NULL) FREE(KindState, kinds->at[i]);
+  }
+  return ok;
+}
+
+/*
+  Swaps arithmetic and comparisons whose operands are sure to
+  be numbers for forms that skip the checks. Those that are
+  only sure when every parameter is a number go in a copy of
+  the code appended at fast_entry, which call() starts in once
+  the arguments pass that one check. The copy keeps the same
+  layout, so its jumps and line numbers stay right.
+*/
+void specialize(ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+
+  function->fast_entry = 0;
+
+  if (chunk->count == 0) return;
+
+  Graph graph;
+
+  if (!decode(&graph, chunk)) {
+    free_graph(&graph);
+    return;
+  }
+
+  find_targets(&graph);
+
+  Kinds kinds = { &graph, function, { false }, NULL };
+  bool* always = ALLOCATE(bool, graph.count);
+  bool* guarded = ALLOCATE(bool, graph.count);
+
+  kinds.at = ALLOCATE(KindState*, graph.count);
+
+  if (find_captured(&kinds) && find_numbers(&kinds, false, always)) {
+    bool more = false;
+
+    for (int i = 0; i < graph.count; i++) {
+      if (always[i]) chunk->code[graph.instrs[i].offset] = num_form(graph.instrs[i].op);
+    }
+
+    if (function->arity > 0 && find_numbers(&kinds, true, guarded)) {
+      for (int i = 0; i < graph.count; i++) more |= guarded[i] && !always[i];
+    }
+
+    if (more) {
+      int entry = chunk->count;
+
+      for (int i = 0; i < graph.count; i++) {
+        Instr* instr = &graph.instrs[i];
+
+        for (int b = 0; b < instr->length; b++) {
+          uint8_t byte = chunk->code[instr->offset + b];
+
+          write_chunk(chunk, b == 0 && guarded[i] ? num_form(instr->op) : byte, instr->line);
+        }
+      }
+
+      function->fast_entry = entry;
+    }
+  }
+
+  FREE_ARRAY(KindState*, kinds.at, graph.count);
+  FREE_ARRAY(bool, always, graph.count);
+  FREE_ARRAY(bool, guarded, graph.count);
+  free_graph(&graph);
+}
+
+// With no backward jumps, every push adding up is a bound that always holds.
+static int sum_pushes(ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+  int height = function->arity + 1;
+
+  for (int offset = 0; offset < chunk->count; offset += instruct_length(chunk, offset)) {
+    int effect = stack_effect(chunk, offset);
+
+    height += effect > 0 ? effect : 0;
+  }
+  return height;
+}
+
+static bool falls_through(uint8_t op) {
+  return op != OP_JUMP && op != OP_RETURN && !is_switch(op);
+}
+
+static bool reach_height(int* at, int target, int height) {
+  bool same = at[target] == -1 || at[target] == height;
+
+  if (at[target] < height) at[target] = height;
+
+  return same;
+}
+
+// Fills `at` with the height each instruction starts at, -1 where
+// nothing reaches. Fails if paths meet at different heights.
+static bool find_heights(Graph* graph, ObjFunc* function, int* at) {
+  Chunk* chunk = graph->chunk;
+  int start = function->arity + 1;
+  bool same = true;
+
+  for (int i = 0; i < graph->count; i++) {
+    int offset = graph->instrs[i].offset;
+
+    at[i] = offset == 0 || offset == function->fast_entry ? start : -1;
+  }
+
+  for (int i = 0; i < graph->count; i++) {
+    Instr* instr = &graph->instrs[i];
+
+    if (at[i] == -1) continue;
+
+    int after = at[i] + stack_effect(chunk, instr->offset);
+
+    if (instr->target != -1) same &= reach_height(at, instr->target, after);
+
+    for (int c = 0; c < case_count(graph, instr); c++) {
+      same &= reach_height(at, graph->cases[instr->first_case + c], after);
+    }
+
+    if (falls_through(instr->op) && i + 1 < graph->count) same &= reach_height(at, i + 1, after);
+  }
+  return same;
+}
+
+/*
+  Follows the height of the stack through the finished code,
+  from the top and from fast_entry, so call() can check a frame
+  has room once rather than on every push.
+*/
+void find_max_stack(ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+
+  function->max_stack = function->arity + 1;
+
+  if (chunk->count == 0) return;
+
+  Graph graph;
+
+  if (!decode(&graph, chunk)) {
+    free_graph(&graph);
+    function->max_stack = sum_pushes(function);
+    return;
+  }
+
+  int* at = ALLOCATE(int, graph.count);
+
+  find_heights(&graph, function, at);
+
+  for (int i = 0; i < graph.count; i++) {
+    int after = at[i] + stack_effect(chunk, graph.instrs[i].offset);
+
+    if (at[i] != -1 && after > function->max_stack) function->max_stack = after;
+  }
+
+  FREE_ARRAY(int, at, graph.count);
+  free_graph(&graph);
+}
+
+// Ops that never allocate, so the collector can't run in the middle of one.
+static bool can_collect(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_GET_FLAT:
+    case OP_EQU:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_DUP:
+    case OP_NOT:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_SWITCH_RANGE:
+    case OP_SWITCH_HASH:
+    case OP_MOVE:
+    case OP_LOADK:
+    case OP_STORE:
+    case OP_ADD_NUM:
+    case OP_SUB_NUM:
+    case OP_MUL_NUM:
+    case OP_DIV_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_NUM:
+    case OP_EQU_NUM:
+    case OP_NEGATE_NUM:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// How many values from the top of the stack an instruction reads. Past the
+// ops that only push, it is taken to be every value it pops and the top.
+static int stack_reads(Chunk* chunk, Instr* instr) {
+  switch (instr->op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVAL:
+    case OP_GET_FLAT:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_JUMP:
+    case OP_MOVE:
+    case OP_LOADK:
+      return 0;
+    default: {
+      if (instr->op >= OP_ADD_RR && instr->op <= OP_EQU_RK) return 0;
+
+      int effect = stack_effect(chunk, instr->offset);
+
+      return effect < 0 ? 1 - effect : 1;
+    }
+  }
+}
+
+static void add_slot(uint32_t* set, int slot) {
+  set[slot / 32] |= 1u << (slot % 32);
+}
+
+// Adds the slots `instr` reads to `set`, and those a closure captures to
+// `always`. Fails on a slot past `slot_count`.
+static bool add_reads(Graph* graph, int i, int height, int slot_count, uint32_t* set, uint32_t* always) {
+  Chunk* chunk = graph->chunk;
+  Instr* instr = &graph->instrs[i];
+  uint8_t* code = &chunk->code[instr->offset];
+  int reads = stack_reads(chunk, instr);
+
+  for (int slot = height - reads; slot < height; slot++) {
+    if (slot >= 0) add_slot(set, slot);
+  }
+
+  int slots[2] = { -1, -1 };
+
+  if (instr->op == OP_GET_LOCAL) slots[0] = first_operand(chunk, instr);
+  else if (instr->op == OP_MOVE) slots[0] = code[2];
+  else if (instr->op >= OP_ADD_RR && instr->op <= OP_EQU_RK) {
+    slots[0] = code[1];
+    // The RR and RK forms alternate.
+    if ((instr->op - OP_ADD_RR) % 2 == 0) slots[1] = code[2];
+  }
+
+  for (int s = 0; s < 2; s++) {
+    if (slots[s] >= slot_count) return false;
+    if (slots[s] != -1) add_slot(set, slots[s]);
+  }
+
+  if (instr->op != OP_CLOSURE) return true;
+
+  int width = instr->wide ? 3 : 1;
+  ObjFunc* inner = AS_FUNC(chunk->constants.values[first_operand(chunk, instr)]);
+  uint8_t* pair = code + instr->wide + 1 + width;
+
+  for (int u = 0; u < inner->upval_count; u++, pair += 1 + width) {
+    int index = instr->wide ? pair[1] | (pair[2] << 8) | (pair[3] << 16) : pair[1];
+
+    if (pair[0] == CAPTURE_UPVAL) continue;
+    if (index >= slot_count) return false;
+
+    // A captured local can be read through its upvalue by any later call.
+    add_slot(pair[0] == CAPTURE_LOCAL ? always : set, index);
+  }
+  return true;
+}
+
+/*
+  Works out, at each instruction the collector can run during,
+  which frame slots are still to be read on some path from
+  there. mark_root clears the rest instead of marking them, so
+  a local that's done with doesn't keep its object alive for
+  the rest of a deep recursion. Reads are only ever added going
+  backwards, never removed by a store, so a frame stopped a
+  little earlier on the same path is still covered.
+*/
+void find_live(ObjFunc* function) {
+  Chunk* chunk = &function->chunk;
+
+  function->live = NULL;
+
+  if (chunk->count == 0) return;
+
+  Graph graph;
+
+  if (!decode(&graph, chunk)) {
+    free_graph(&graph);
+    return;
+  }
+
+  int words = (function->max_stack + 31) / 32;
+  int* at = ALLOCATE(int, graph.count);
+  uint32_t* live = ALLOCATE(uint32_t, graph.count * words);
+  uint32_t* always = ALLOCATE(uint32_t, words);
+  bool ok = find_heights(&graph, function, at);
+
+  for (int w = 0; w < words; w++) always[w] = 0;
+
+  for (int i = graph.count - 1; i >= 0 && ok; i--) {
+    Instr* instr = &graph.instrs[i];
+    uint32_t* set = &live[i * words];
+
+    for (int w = 0; w < words; w++) set[w] = 0;
+
+    if (at[i] == -1) continue;
+
+    // Jumps only go forward, so every successor is done already.
+    if (instr->target != -1) {
+      for (int w = 0; w < words; w++) set[w] |= live[instr->target * words + w];
+    }
+
+    for (int c = 0; c < case_count(&graph, instr); c++) {
+      int target = graph.cases[instr->first_case + c];
+
+      for (int w = 0; w < words; w++) set[w] |= live[target * words + w];
+    }
+
+    if (falls_through(instr->op) && i + 1 < graph.count) {
+      for (int w = 0; w < words; w++) set[w] |= live[(i + 1) * words + w];
+    }
+
+    ok = add_reads(&graph, i, at[i], words * 32, set, always);
+  }
+
+  if (ok) {
+    LiveMap* map = ALLOCATE(LiveMap, 1);
+    int count = 0;
+
+    for (int i = 0; i < graph.count; i++) count += at[i] != -1 && can_collect(graph.instrs[i].op);
+
+    map->count = count;
+    map->words = words;
+    map->points = ALLOCATE(Safepoint, count);
+    map->live = ALLOCATE(uint32_t, count * words);
+
+    for (int i = 0, p = 0; i < graph.count; i++) {
+      if (at[i] == -1 || !can_collect(graph.instrs[i].op)) continue;
+
+      map->points[p] = (Safepoint){ graph.instrs[i].offset, graph.instrs[i].length, at[i] };
+
+      for (int w = 0; w < words; w++) map->live[p * words + w] = live[i * words + w] | always[w];
+
+      p++;
+    }
+
+    function->live = map;
+  }
+
+  FREE_ARRAY(int, at, graph.count);
+  FREE_ARRAY(uint32_t, live, graph.count * words);
+  FREE_ARRAY(uint32_t, always, words);
+  free_graph(&graph);
+}
+
+void free_live(LiveMap* map) {
+  FREE_ARRAY(Safepoint, map->points, map->count);
+  FREE_ARRAY(uint32_t, map->live, map->count * map->words);
+  FREE(LiveMap, map);
+}
+
+const uint32_t* live_slots(ObjFunc* function, uint8_t* ip, int* height) {
+  LiveMap* map = function->live;
+  int at = (int)(ip - function->chunk.code) - 1;
+
+  // A frame that hasn't started yet is past no instruction.
+  if (map == NULL || at + 1 == 0 || at + 1 == function->fast_entry) return NULL;
+
+  int low = 0;
+  int high = map->count - 1;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    Safepoint* point = &map->points[mid];
+
+    if (at < point->offset) {
+      high = mid - 1;
+    }
+    else if (at >= point->offset + point->length) {
+      low = mid + 1;
+    }
+    else {
+      *height = point->height;
+      return &map->live[mid * map->words];
+    }
+  }
+  return NULL;
+}
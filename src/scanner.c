@@ -2,11 +2,6 @@
 #include <string.h>
 #include "include/scanner.h"
 #include "include/common.h"
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
 
 Scanner scanner;
 
@@ -135,7 +130,14 @@ static TokenType ident_type() {
       }
       break;
     case 'i': return check_keyword(1, 1, "f", T_IF);
-    case 'm': return check_keyword(1, 4, "atch", T_MATCH);
+    case 'm':
+      if (scanner.current - scanner.start > 1) {
+        switch (scanner.start[1]) {
+          case 'a': return check_keyword(2, 3, "tch", T_MATCH);
+          case 'e': return check_keyword(2, 2, "mo", T_MEMO);
+        }
+      }
+      break;
     case 'n': return check_keyword(1, 2, "il", T_NIL);
     case 'o': return check_keyword(1, 1, "r", T_OR);
     case 'p': return check_keyword(1, 3, "uts", T_PRINT);
@@ -0,0 +1,260 @@
+// Strings, strings, strings.
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "include/strlib.h"
+#include "include/memory.h"
+#include "include/object.h"
+#include "include/vm.h"
+
+/*
+  Finds the first occurrence of needle in hay, or -1.
+  With SSE2, 16 candidate positions are tested at a time
+  by comparing both the first and the last byte of the
+  needle, and memcmp only runs on positions passing both.
+*/
+int find_bytes(const char* hay, int hay_length, const char* needle, int needle_length) {
+  if (needle_length == 0) return 0;
+  if (needle_length > hay_length) return -1;
+
+  if (needle_length == 1) {
+    const char* found = memchr(hay, needle[0], hay_length);
+    return found == NULL ? -1 : (int)(found - hay);
+  }
+
+  int i = 0;
+  int last = needle_length - 1;
+
+  #ifdef __SSE2__
+  const __m128i first_byte = _mm_set1_epi8(needle[0]);
+  const __m128i last_byte = _mm_set1_epi8(needle[last]);
+
+  for (; i + last + 16 <= hay_length; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i*)(hay + i + last));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+      _mm_cmpeq_epi8(first_byte, block_first),
+      _mm_cmpeq_epi8(last_byte, block_last)));
+
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+
+      if (memcmp(hay + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  #endif
+
+  while (i + last < hay_length) {
+    const char* found = memchr(hay + i, needle[0], hay_length - last - i);
+
+    if (found == NULL) return -1;
+
+    i = (int)(found - hay);
+
+    if (hay[i + last] == needle[last] && memcmp(hay + i + 1, needle + 1, needle_length - 2) == 0) {
+      return i;
+    }
+    i++;
+  }
+  return -1;
+}
+
+static bool expect_args(const char* name, int arg_count, int min, int max) {
+  if (arg_count < min || arg_count > max) {
+    if (min == max) {
+      runtime_err("`%s` expected %d arguments, but got %d instead.", name, min, arg_count);
+    }
+    else {
+      runtime_err("`%s` expected %d to %d arguments, but got %d instead.", name, min, max, arg_count);
+    }
+    return false;
+  }
+  return true;
+}
+
+static bool expect_string(const char* name, Value value) {
+  if (!IS_STRING(value)) {
+    runtime_err("`%s` expected a string.", name);
+    return false;
+  }
+  return true;
+}
+
+static bool expect_index(const char* name, Value value, int min, int max, int* index) {
+  double number = IS_NUM(value) ? AS_NUM(value) : NAN;
+
+  // The range goes first, as casting anything an int can't hold is undefined.
+  if (!isfinite(number) || number < INT_MIN || number > INT_MAX || number != (int)number) {
+    runtime_err("`%s` expected a whole number.", name);
+    return false;
+  }
+
+  *index = (int)number;
+
+  if (*index < min || *index > max) {
+    runtime_err("`%s` index %d is out of range.", name, *index);
+    return false;
+  }
+  return true;
+}
+
+static bool length_native(int arg_count, Value* args) {
+  if (!expect_args("length", arg_count, 1, 1)) return false;
+  if (!expect_string("length", args[0])) return false;
+
+  args[-1] = NUM_VAL(AS_STRING(args[0])->length);
+
+  return true;
+}
+
+static bool substring_native(int arg_count, Value* args) {
+  if (!expect_args("substring", arg_count, 2, 3)) return false;
+  if (!expect_string("substring", args[0])) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  int start;
+  int end = string->length;
+
+  if (!expect_index("substring", args[1], 0, string->length, &start)) return false;
+
+  if (arg_count == 3 && !expect_index("substring", args[2], start, string->length, &end)) {
+    return false;
+  }
+
+  args[-1] = OBJ_VAL(slice_string(string, start, end - start));
+
+  return true;
+}
+
+static bool char_at_native(int arg_count, Value* args) {
+  if (!expect_args("char_at", arg_count, 2, 2)) return false;
+  if (!expect_string("char_at", args[0])) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  int index;
+
+  if (!expect_index("char_at", args[1], 0, string->length - 1, &index)) return false;
+
+  args[-1] = OBJ_VAL(slice_string(string, index, 1));
+
+  return true;
+}
+
+static bool index_of_native(int arg_count, Value* args) {
+  if (!expect_args("index_of", arg_count, 2, 3)) return false;
+  if (!expect_string("index_of", args[0])) return false;
+  if (!expect_string("index_of", args[1])) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* needle = AS_STRING(args[1]);
+  int from = 0;
+
+  if (arg_count == 3 && !expect_index("index_of", args[2], 0, string->length, &from)) {
+    return false;
+  }
+
+  int found = find_bytes(string->chars + from, string->length - from, needle->chars, needle->length);
+
+  args[-1] = NUM_VAL(found == -1 ? -1 : found + from);
+
+  return true;
+}
+
+static bool starts_with_native(int arg_count, Value* args) {
+  if (!expect_args("starts_with", arg_count, 2, 2)) return false;
+  if (!expect_string("starts_with", args[0])) return false;
+  if (!expect_string("starts_with", args[1])) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* prefix = AS_STRING(args[1]);
+
+  args[-1] = BOOL_VAL(prefix->length <= string->length && memcmp(string->chars, prefix->chars, prefix->length) == 0);
+
+  return true;
+}
+
+/*
+  Without arrays, split hands back a chain of Pair instances,
+  `head` holding each piece and `tail` the rest (or nil),
+  which is easy to walk recursively.
+*/
+static bool split_native(int arg_count, Value* args) {
+  if (!expect_args("split", arg_count, 2, 2)) return false;
+  if (!expect_string("split", args[0])) return false;
+  if (!expect_string("split", args[1])) return false;
+
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* sep = AS_STRING(args[1]);
+
+  if (sep->length == 0) {
+    runtime_err("`split` expected a non-empty separator.");
+    return false;
+  }
+
+  ObjString* head = copy_string("head", 4);
+  push(OBJ_VAL(head));
+  ObjString* tail = copy_string("tail", 4);
+  push(OBJ_VAL(tail));
+
+  // The first pair lives here, keeping the whole chain reachable.
+  push(NIL_VAL);
+  Value* first = vm.stack_top - 1;
+
+  ObjInst* last = NULL;
+  int start = 0;
+
+  for (;;) {
+    int found = find_bytes(string->chars + start, string->length - start, sep->chars, sep->length);
+    int end = found == -1 ? string->length : start + found;
+
+    push(OBJ_VAL(slice_string(string, start, end - start)));
+
+    ObjInst* pair = new_inst(vm.pair_class);
+    push(OBJ_VAL(pair));
+
+    set_table(&pair->fields, head, vm.stack_top[-2]);
+    set_table(&pair->fields, tail, NIL_VAL);
+
+    if (last == NULL) {
+      *first = OBJ_VAL(pair);
+    }
+    else {
+      set_table(&last->fields, tail, OBJ_VAL(pair));
+    }
+
+    pop();
+    pop();
+
+    last = pair;
+
+    if (found == -1) break;
+
+    start = end + sep->length;
+  }
+
+  args[-1] = *first;
+
+  pop();
+  pop();
+  pop();
+
+  return true;
+}
+
+void define_strlib() {
+  set_table(&vm.globals, vm.pair_class->name, OBJ_VAL(vm.pair_class));
+
+  define_native("length", length_native);
+  define_native("substring", substring_native);
+  define_native("char_at", char_at_native);
+  define_native("index_of", index_of_native);
+  define_native("starts_with", starts_with_native);
+  define_native("split", split_native);
+}
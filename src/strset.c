@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include "include/memory.h"
+#include "include/object.h"
+#include "include/strset.h"
+
+#define STRSET_MAX_LOAD 0.75
+#define STRSET_MIN_LOAD 0.25
+
+void init_strset(StrSet* set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->keys = NULL;
+  set->hashes = NULL;
+}
+
+void free_strset(StrSet* set) {
+  FREE_ARRAY(ObjString*, set->keys, set->capacity);
+  FREE_ARRAY(uint32_t, set->hashes, set->capacity);
+  init_strset(set);
+}
+
+static void resize(StrSet* set, int capacity) {
+  ObjString** keys = ALLOCATE(ObjString*, capacity);
+  uint32_t* hashes = ALLOCATE(uint32_t, capacity);
+
+  for (int i = 0; i < capacity; i++) {
+    keys[i] = NULL;
+  }
+
+  for (int i = 0; i < set->capacity; i++) {
+    if (set->keys[i] == NULL) continue;
+
+    uint32_t index = set->hashes[i] & (capacity - 1);
+
+    while (keys[index] != NULL) {
+      index = (index + 1) & (capacity - 1);
+    }
+
+    keys[index] = set->keys[i];
+    hashes[index] = set->hashes[i];
+  }
+
+  FREE_ARRAY(ObjString*, set->keys, set->capacity);
+  FREE_ARRAY(uint32_t, set->hashes, set->capacity);
+
+  set->keys = keys;
+  set->hashes = hashes;
+  set->capacity = capacity;
+}
+
+void strset_add(StrSet* set, ObjString* key) {
+  if (set->count + 1 > set->capacity * STRSET_MAX_LOAD) {
+    resize(set, GROW_CAPACITY(set->capacity));
+  }
+  else if (set->capacity > 8 && set->count < set->capacity * STRSET_MIN_LOAD) {
+    // Sweeps only ever shrink the set, so give the memory
+    // back here, where allocating is safe.
+    int capacity = set->capacity;
+
+    while (capacity > 8 && set->count + 1 < capacity * STRSET_MIN_LOAD) {
+      capacity /= 2;
+    }
+    resize(set, capacity);
+  }
+
+  uint32_t index = key->hash & (set->capacity - 1);
+
+  while (set->keys[index] != NULL) {
+    index = (index + 1) & (set->capacity - 1);
+  }
+
+  set->keys[index] = key;
+  set->hashes[index] = key->hash;
+  set->count++;
+}
+
+ObjString* strset_find(StrSet* set, const char* chars, int length, uint32_t hash) {
+  if (set->count == 0) return NULL;
+
+  uint32_t index = hash & (set->capacity - 1);
+
+  for (;;) {
+    ObjString* key = set->keys[index];
+
+    if (key == NULL) return NULL;
+
+    if (set->hashes[index] == hash && key->length == length && memcmp(key->chars, chars, length) == 0) {
+      return key;
+    }
+    index = (index + 1) & (set->capacity - 1);
+  }
+}
+
+static void remove_at(StrSet* set, uint32_t hole) {
+  uint32_t mask = set->capacity - 1;
+  uint32_t index = (hole + 1) & mask;
+
+  // Pull later members of the cluster back into the hole
+  // whenever doing so keeps them reachable from their home
+  // slot, so probe sequences never have to skip a gap.
+  while (set->keys[index] != NULL) {
+    uint32_t home = set->hashes[index] & mask;
+
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      set->keys[hole] = set->keys[index];
+      set->hashes[hole] = set->hashes[index];
+      hole = index;
+    }
+    index = (index + 1) & mask;
+  }
+
+  set->keys[hole] = NULL;
+  set->count--;
+}
+
+void strset_rmwhi(StrSet* set) {
+  int i = 0;
+
+  while (i < set->capacity) {
+    ObjString* key = set->keys[i];
+
+    // A removal may shift another key into slot i, so only
+    // move on once the slot holds a survivor or nothing.
+    if (key != NULL && !key->obj.is_marked) {
+      remove_at(set, i);
+    }
+    else {
+      i++;
+    }
+  }
+}
@@ -1,155 +1,305 @@
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "include/memory.h"
 #include "include/object.h"
 #include "include/table.h"
 #include "include/value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define CTRL_EMPTY   ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Full slots hold the low 7 bits of the hash, the rest of
+// the hash picks the starting group.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_CTRL(hash)  ((int8_t)((hash) & 0x7f))
+
+// Keep at most 7/8ths of the slots in use, tombstones included.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+static inline GroupMask match_ctrl(const int8_t* group, int8_t ctrl) {
+  __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(ctrl)));
+}
+
+static inline GroupMask match_free(const int8_t* group) {
+  // EMPTY and DELETED are the only control bytes with the
+  // sign bit set.
+  return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline GroupMask match_ctrl(const int8_t* group, int8_t ctrl) {
+  GroupMask mask = 0;
+
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    mask |= (GroupMask)(group[i] == ctrl) << i;
+  }
+  return mask;
+}
+
+static inline GroupMask match_free(const int8_t* group) {
+  GroupMask mask = 0;
+
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    mask |= (GroupMask)(group[i] < 0) << i;
+  }
+  return mask;
+}
+#endif
+
+static inline int first_bit(GroupMask mask) {
+  return __builtin_ctz(mask);
+}
+
+static size_t table_bytes(int capacity) {
+  return (size_t)capacity * (sizeof(Entry) + sizeof(int8_t));
+}
 
 void init_table(Table* table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
-  table->entries = NULL;
 }
 
 void free_table(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  if (table->capacity > 0) {
+    FREE_ARRAY(uint8_t, table->as.hashed.entries, table_bytes(table->capacity));
+  }
   init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
+static inline int find_small(Table* table, ObjString* key) {
+  for (int i = 0; i < table->count; i++) {
+    if (table->as.small.keys[i] == key) return i;
+  }
+  return -1;
+}
 
-  for (;;) {
-    Entry* entry = &entries[index];
+static inline int find_slot(Table* table, ObjString* key) {
+  uint32_t wrap = (uint32_t)table->capacity / TABLE_GROUP - 1;
+  uint32_t group = HASH_GROUP(key->hash) & wrap;
+  int8_t ctrl = HASH_CTRL(key->hash);
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        return tombstone != NULL ? tombstone : entry;
-      }
-      else {
-        if (tombstone == NULL) tombstone = entry;
-      }
-    }
-    else if (entry->key == key) {
-      return entry;
+  for (uint32_t step = 1;; step++) {
+    int base = group * TABLE_GROUP;
+    const int8_t* bytes = table->as.hashed.ctrl + base;
+
+    for (GroupMask mask = match_ctrl(bytes, ctrl); mask != 0; mask &= mask - 1) {
+      int slot = base + first_bit(mask);
+
+      if (table->as.hashed.entries[slot].key == key) return slot;
     }
-    index = (index + 1) & (capacity - 1);
+
+    // Nothing was ever pushed past a group that still has
+    // an empty slot, so the key is not in the table.
+    if (match_ctrl(bytes, CTRL_EMPTY) != 0) return -1;
+
+    group = (group + step) & wrap;
+  }
+}
+
+static int find_free(int8_t* ctrl, int capacity, uint32_t hash) {
+  int groups = capacity / TABLE_GROUP;
+  uint32_t group = HASH_GROUP(hash) & (groups - 1);
+
+  for (int step = 1;; step++) {
+    GroupMask mask = match_free(ctrl + group * TABLE_GROUP);
+
+    if (mask != 0) return group * TABLE_GROUP + first_bit(mask);
+
+    group = (group + step) & (groups - 1);
   }
 }
 
 bool get_table(Table* table, ObjString* key, Value* value) {
+  if (table->capacity == 0) {
+    int index = find_small(table, key);
+    if (index == -1) return false;
+
+    *value = table->as.small.values[index];
+
+    return true;
+  }
+
   if (table->count == 0) return false;
 
-  Entry* entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = find_slot(table, key);
+  if (slot == -1) return false;
 
-  *value = entry->value;
+  *value = table->as.hashed.entries[slot].value;
 
   return true;
 }
 
-static void adj_capacity(Table* table, int capacity) {
-  Entry* entries = ALLOCATE(Entry, capacity);
+static void insert_entry(int8_t* ctrl, Entry* entries, int capacity, ObjString* key, Value value) {
+  int slot = find_free(ctrl, capacity, key->hash);
 
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+  ctrl[slot] = HASH_CTRL(key->hash);
+  entries[slot].key = key;
+  entries[slot].value = value;
+}
 
-  table->count = 0;
+static void adj_capacity(Table* table, int capacity) {
+  uint8_t* block = ALLOCATE(uint8_t, table_bytes(capacity));
+  Entry* entries = (Entry*)block;
+  int8_t* ctrl = (int8_t*)(block + sizeof(Entry) * capacity);
 
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
+  memset(ctrl, (uint8_t)CTRL_EMPTY, capacity);
 
-    if (entry->key == NULL) continue;
+  // The small arrays share space with the hashed fields, so
+  // everything is read out before the table is overwritten.
+  if (table->capacity == 0) {
+    for (int i = 0; i < table->count; i++) {
+      insert_entry(ctrl, entries, capacity, table->as.small.keys[i], table->as.small.values[i]);
+    }
+  }
+  else {
+    for (int i = 0; i < table->capacity; i++) {
+      if (table->as.hashed.ctrl[i] < 0) continue;
 
-    Entry* dest = find_entry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+      Entry* entry = &table->as.hashed.entries[i];
+      insert_entry(ctrl, entries, capacity, entry->key, entry->value);
+    }
 
-    table->count++;
+    FREE_ARRAY(uint8_t, table->as.hashed.entries, table_bytes(table->capacity));
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-
-  table->entries = entries;
+  table->as.hashed.entries = entries;
+  table->as.hashed.ctrl = ctrl;
   table->capacity = capacity;
+  table->tombstones = 0;
 }
 
 bool set_table(Table* table, ObjString* key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adj_capacity(table, capacity);
-  }
+  if (table->capacity == 0) {
+    int index = find_small(table, key);
 
-  Entry* entry = find_entry(table->entries, table->capacity, key);
+    if (index != -1) {
+      table->as.small.values[index] = value;
+      return false;
+    }
 
-  bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value)) table->count++;
+    if (table->count < TABLE_SMALL) {
+      table->as.small.keys[table->count] = key;
+      table->as.small.values[table->count] = value;
+      table->count++;
 
-  entry->key = key;
-  entry->value = value;
+      return true;
+    }
 
-  return is_new_key;
-}
+    // One group still leaves the ninth entry well under TABLE_MAX_LOAD.
+    adj_capacity(table, TABLE_GROUP);
+  }
+  else {
+    int slot = find_slot(table, key);
 
-bool del_table(Table* table, ObjString* key) {
-  if (table->count == 0) return false;
+    if (slot != -1) {
+      table->as.hashed.entries[slot].value = value;
+      return false;
+    }
 
-  Entry* entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+      // Mostly tombstones? Then rehashing in place is enough.
+      int capacity = table->capacity;
 
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+      if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2) {
+        capacity *= 2;
+      }
+      adj_capacity(table, capacity);
+    }
+  }
+
+  int slot = find_free(table->as.hashed.ctrl, table->capacity, key->hash);
+
+  if (table->as.hashed.ctrl[slot] == CTRL_DELETED) table->tombstones--;
+
+  table->as.hashed.ctrl[slot] = HASH_CTRL(key->hash);
+  table->as.hashed.entries[slot].key = key;
+  table->as.hashed.entries[slot].value = value;
+  table->count++;
 
   return true;
 }
 
-void table_add_all(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
+static void remove_small(Table* table, int index) {
+  // Order doesn't matter, so the last entry fills the gap.
+  table->count--;
+  table->as.small.keys[index] = table->as.small.keys[table->count];
+  table->as.small.values[index] = table->as.small.values[table->count];
+}
 
-    if (entry->key != NULL) {
-      set_table(to, entry->key, entry->value);
-    }
+static void remove_slot(Table* table, int slot) {
+  int8_t* group = table->as.hashed.ctrl + slot / TABLE_GROUP * TABLE_GROUP;
+
+  // A group that still has an empty slot never made a probe
+  // move on, so the slot can go straight back to empty.
+  if (match_ctrl(group, CTRL_EMPTY) != 0) {
+    table->as.hashed.ctrl[slot] = CTRL_EMPTY;
+  }
+  else {
+    table->as.hashed.ctrl[slot] = CTRL_DELETED;
+    table->tombstones++;
   }
-}
 
-ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
+  table->as.hashed.entries[slot].key = NULL;
+  table->as.hashed.entries[slot].value = NIL_VAL;
+  table->count--;
+}
 
-  uint32_t index = hash & (table->capacity - 1);
+bool del_table(Table* table, ObjString* key) {
+  if (table->capacity == 0) {
+    int index = find_small(table, key);
+    if (index == -1) return false;
 
-  for (;;) {
-    Entry* entry = &table->entries[index];
+    remove_small(table, index);
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    }
-    else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
-    }
-    index = (index + 1) & (table->capacity - 1);
+    return true;
   }
+
+  if (table->count == 0) return false;
+
+  int slot = find_slot(table, key);
+  if (slot == -1) return false;
+
+  remove_slot(table, slot);
+
+  return true;
 }
 
-void table_rmwhi(Table* table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
+void table_add_all(Table* from, Table* to) {
+  if (from->capacity == 0) {
+    for (int i = 0; i < from->count; i++) {
+      set_table(to, from->as.small.keys[i], from->as.small.values[i]);
+    }
+    return;
+  }
 
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      del_table(table, entry->key);
+  for (int i = 0; i < from->capacity; i++) {
+    if (from->as.hashed.ctrl[i] >= 0) {
+      set_table(to, from->as.hashed.entries[i].key, from->as.hashed.entries[i].value);
     }
   }
 }
 
 void mark_table(Table* table) {
+  if (table->capacity == 0) {
+    for (int i = 0; i < table->count; i++) {
+      mark_obj((Obj*)table->as.small.keys[i]);
+      mark_val(table->as.small.values[i]);
+    }
+    return;
+  }
+
   for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    
+    if (table->as.hashed.ctrl[i] < 0) continue;
+
+    Entry* entry = &table->as.hashed.entries[i];
+
     mark_obj((Obj*)entry->key);
     mark_val(entry->value);
   }
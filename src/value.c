@@ -71,3 +71,34 @@ bool value_equ(Value a, Value b) {
   }
   #endif
 }
+
+// A value's bits, so 0 and -0 stay apart. Constants and memo
+// keys are only the same if these are.
+uint64_t value_bits(Value value) {
+  #ifdef NAN_TAGGING
+  return value;
+  #else
+  uint64_t bits = 0;
+
+  if (IS_NUM(value)) memcpy(&bits, &value.as.num, sizeof(double));
+  else if (IS_OBJ(value)) bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  else if (IS_BOOL(value)) bits = AS_BOOL(value);
+
+  return bits ^ ((uint64_t)value.type << 60);
+  #endif
+}
+
+// Hashes the numbers and strings a switch table holds, with 0 and -0 alike.
+uint32_t hash_value(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+  double num = AS_NUM(value) + 0.0;
+  uint64_t bits;
+
+  memcpy(&bits, &num, sizeof(double));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdu;
+  bits ^= bits >> 33;
+
+  return (uint32_t)bits;
+}
@@ -8,11 +8,22 @@
 #include "include/compiler.h"
 #include "include/object.h"
 #include "include/memory.h"
+#include "include/memo.h"
+#include "include/jit.h"
+#include "include/strlib.h"
+#include "include/cache.h"
+#include "include/layout.h"
 
 VM vm;
 
-static Value clock_native(int arg_count, Value* args) {
-  return NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clock_native(int arg_count, Value* args) {
+  args[-1] = NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool memory_native(int arg_count, Value* args) {
+  args[-1] = NUM_VAL((double)vm.alloced_bytes);
+  return true;
 }
 
 static void reset_stack() {
@@ -21,7 +32,7 @@ static void reset_stack() {
   vm.open_upvals = NULL;
 }
 
-static void runtime_err(const char* format, ...) {
+void runtime_err(const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -34,19 +45,19 @@ static void runtime_err(const char* format, ...) {
     ObjFunc* function = frame->closure->function;
     size_t instruct = frame->ip - function->chunk.code - 1;
 
-    fprintf(stderr, "[ line %d ] in ", function->chunk.lines[instruct]);
+    fprintf(stderr, "[ line %d ] in ", get_line(&function->chunk, (int)instruct));
 
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     }
     else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(stderr, "%.*s()\n", function->name->length, function->name->chars);
     }
   }
   reset_stack();
 }
 
-static void define_native(const char* name, NativeFn function) {
+void define_native(const char* name, NativeFn function) {
   push(OBJ_VAL(copy_string(name, (int)strlen(name))));
   push(OBJ_VAL(new_native(function)));
 
@@ -65,23 +76,35 @@ void init_vm() {
   vm.gcount = 0;
   vm.gcap = 0;
   vm.gstack = NULL;
+  vm.jit = false;
+  vm.aot = false;
 
   init_table(&vm.globals);
-  init_table(&vm.strings);
+  init_strset(&vm.strings);
 
   vm.init_string = NULL;
+  vm.pair_class = NULL;
   vm.init_string = copy_string("init", 4);
 
+  push(OBJ_VAL(copy_string("Pair", 4)));
+  vm.pair_class = new_class(AS_STRING(vm.stack[0]));
+  pop();
+
   define_native("clock", clock_native);
+  define_native("memory", memory_native);
+  define_strlib();
 }
 
 void free_vm() {
   free_table(&vm.globals);
-  free_table(&vm.strings);
+  free_strset(&vm.strings);
 
   vm.init_string = NULL;
+  vm.pair_class = NULL;
 
   free_obj();
+  free_cache();
+  free_code();
 }
 
 void push(Value value) {
@@ -98,21 +121,113 @@ static Value peek(int dist) {
   return vm.stack_top[-1 - dist];
 }
 
+// Whether the stack fits every slot a new frame can use, which saves checking each push.
+static inline bool has_room(ObjFunc* function, int arg_count) {
+  return vm.stack_top - arg_count - 1 + function->max_stack + STACK_RESERVE <= vm.stack + STACK_MAX;
+}
+
+// Where a call starts. The copy at fast_entry counts on every argument being a number.
+static inline uint8_t* entry_point(ObjFunc* function, Value* args) {
+  if (function->fast_entry == 0) return function->chunk.code;
+
+  for (int i = 0; i < function->arity; i++) {
+    if (!IS_NUM(args[i])) return function->chunk.code;
+  }
+
+  return function->chunk.code + function->fast_entry;
+}
+
+// Runs a trivial body in place, as if it had returned. Getters and
+// setters that would end up somewhere unusual get a frame instead.
+static bool call_trivial(ObjFunc* function, int arg_count) {
+  Value* slots = vm.stack_top - arg_count - 1;
+  Value result;
+
+  switch (function->trivial) {
+    case TRIVIAL_CONST:
+      result = function->trivial_value;
+      break;
+    case TRIVIAL_LOCAL:
+      result = slots[function->trivial_slot];
+      break;
+    case TRIVIAL_GETTER:
+      if (!IS_INST(slots[0]) ||
+          !get_table(&AS_INST(slots[0])->fields, AS_STRING(function->trivial_value), &result)) {
+        return false;
+      }
+      break;
+    case TRIVIAL_SETTER:
+      if (!IS_INST(slots[0])) return false;
+
+      set_table(&AS_INST(slots[0])->fields, AS_STRING(function->trivial_value), slots[1]);
+      result = NIL_VAL;
+      break;
+    default:
+      return false;
+  }
+
+  vm.stack_top = slots;
+  push(result);
+
+  return true;
+}
+
 static bool call(ObjClose* closure, int arg_count) {
   if (arg_count != closure->function->arity) {
     runtime_err("Expected %d arguments, but got %d instead.", closure->function->arity, arg_count);
     return false;
   }
 
+  if (closure->function->trivial != TRIVIAL_NONE && call_trivial(closure->function, arg_count)) {
+    return true;
+  }
+
+  Memo* memo = closure->memo;
+  uint32_t hash = 0;
+
+  if (memo != NULL) {
+    Value* args = vm.stack_top - arg_count;
+    Value result;
+
+    hash = hash_args(args, arg_count);
+
+    if (get_memo(memo, args, hash, &result)) {
+      vm.stack_top = args - 1;
+      push(result);
+      return true;
+    }
+  }
+
   if (vm.frame_count == FRAMES_MAX) {
     runtime_err("Stack overflow.");
     return false;
   }
 
+  ObjFunc* function = closure->function;
+
+  if (function->lazy != NULL && !compile_body(function)) {
+    runtime_err("Could not compile `%.*s`.", function->name->length, function->name->chars);
+    return false;
+  }
+
+  if (!has_room(function, arg_count)) {
+    runtime_err("Stack overflow.");
+    return false;
+  }
+
+  #ifdef NVM_JIT
+  if (vm.jit && function->calls < JIT_THRESHOLD && ++function->calls == JIT_THRESHOLD) jit_compile(function);
+  #endif
+
   CallFrame* frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
   frame->slots = vm.stack_top - arg_count - 1;
+  frame->ip = entry_point(function, frame->slots + 1);
+
+  if (memo != NULL) {
+    frame->memo_index = add_memo(memo, frame->slots + 1, hash);
+    frame->memo_id = memo->entries[frame->memo_index].id;
+  }
 
   return true;
 }
@@ -132,10 +247,8 @@ static bool call_val(Value callee, int arg_count) {
 
         vm.stack_top[-arg_count - 1] = OBJ_VAL(new_inst(klass));
 
-        Value initializer;
-
-        if (get_table(&klass->methods, vm.init_string, &initializer)) {
-          return call(AS_CLOSURE(initializer), arg_count);
+        if (klass->initializer != NULL) {
+          return call(klass->initializer, arg_count);
         }
         else if (arg_count != 0) {
           runtime_err("Expected no arguments but got %d instead.", arg_count);
@@ -147,11 +260,12 @@ static bool call_val(Value callee, int arg_count) {
         return call(AS_CLOSURE(callee), arg_count);
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
-        Value result = native(arg_count, vm.stack_top - arg_count);
 
-        vm.stack_top -= arg_count + 1;
+        if (!native(arg_count, vm.stack_top - arg_count)) {
+          return false;
+        }
 
-        push(result);
+        vm.stack_top -= arg_count;
 
         return true;
       }
@@ -163,11 +277,45 @@ static bool call_val(Value callee, int arg_count) {
   return false;
 }
 
+/*
+  The call instructions' way in. A closure that needs a frame, as most
+  do, gets it pushed right here. Returns the frame to carry on in, or
+  NULL after a runtime error.
+*/
+static inline CallFrame* call_from(int arg_count) {
+  Value callee = peek(arg_count);
+
+  if (IS_CLOSURE(callee)) {
+    ObjClose* closure = AS_CLOSURE(callee);
+    ObjFunc* function = closure->function;
+
+    if (function->arity == arg_count && function->trivial == TRIVIAL_NONE &&
+        function->lazy == NULL && closure->memo == NULL && vm.frame_count < FRAMES_MAX &&
+        has_room(function, arg_count)) {
+      #ifdef NVM_JIT
+      if (vm.jit && function->calls < JIT_THRESHOLD && ++function->calls == JIT_THRESHOLD) jit_compile(function);
+      #endif
+
+      CallFrame* frame = &vm.frames[vm.frame_count++];
+
+      frame->closure = closure;
+      frame->slots = vm.stack_top - arg_count - 1;
+      frame->ip = entry_point(function, frame->slots + 1);
+
+      return frame;
+    }
+  }
+
+  if (!call_val(callee, arg_count)) return NULL;
+
+  return &vm.frames[vm.frame_count - 1];
+}
+
 static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count) {
   Value method;
 
-  if (!get_table(&klass->methods, name, &method)) {
-    runtime_err("Undefined property `%s`.", name->chars);
+  if (!get_table(&klass->methods_from->methods, name, &method)) {
+    runtime_err("Undefined property `%.*s`.", name->length, name->chars);
     return false;
   }
 
@@ -196,8 +344,8 @@ static bool invoke(ObjString* name, int arg_count) {
 static bool bind_method(ObjClass* klass, ObjString* name) {
   Value method;
 
-  if (!get_table(&klass->methods, name, &method)) {
-    runtime_err("Undefined property `%s`.", name->chars);
+  if (!get_table(&klass->methods_from->methods, name, &method)) {
+    runtime_err("Undefined property `%.*s`.", name->length, name->chars);
     return false;
   }
 
@@ -224,6 +372,8 @@ static ObjUpval* capture_upval(Value* local) {
 
   ObjUpval* created_upval = new_upval(local);
 
+  created_upval->next = upval;
+
   if (prev_upval == NULL) {
     vm.open_upvals = created_upval;
   }
@@ -247,7 +397,15 @@ static void def_method(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
 
+  if (klass->methods_from != klass) {
+    table_add_all(&klass->methods_from->methods, &klass->methods);
+    klass->methods_from = klass;
+  }
+
   set_table(&klass->methods, name, method);
+
+  if (name == vm.init_string) klass->initializer = AS_CLOSURE(method);
+
   pop();
 }
 
@@ -275,6 +433,124 @@ static void concat() {
   push(OBJ_VAL(result));
 }
 
+/*
+  The handlers below are shared by the narrow instructions
+  and their OP_WIDE forms, which only differ in how their
+  operands are read.
+*/
+static inline bool get_global(ObjString* name) {
+  Value value;
+
+  if (!get_table(&vm.globals, name, &value)) {
+    runtime_err("Undefined variable `%.*s`.", name->length, name->chars);
+    return false;
+  }
+
+  push(value);
+
+  return true;
+}
+
+static inline bool set_global(ObjString* name) {
+  if (set_table(&vm.globals, name, peek(0))) {
+    del_table(&vm.globals, name);
+    runtime_err("Undefined variable `%.*s`.", name->length, name->chars);
+    return false;
+  }
+  return true;
+}
+
+static inline bool get_prop(ObjString* name) {
+  if (!IS_INST(peek(0))) {
+    runtime_err("Only instances can have properties.");
+    return false;
+  }
+
+  ObjInst* inst = AS_INST(peek(0));
+  Value value;
+
+  if (get_table(&inst->fields, name, &value)) {
+    pop();
+    push(value);
+
+    return true;
+  }
+
+  return bind_method(inst->klass, name);
+}
+
+static inline bool set_prop(ObjString* name) {
+  if (!IS_INST(peek(1))) {
+    runtime_err("Only instances can have fields.");
+    return false;
+  }
+
+  ObjInst* inst = AS_INST(peek(1));
+
+  set_table(&inst->fields, name, peek(0));
+
+  Value value = pop();
+
+  pop();
+  push(value);
+
+  return true;
+}
+
+static inline void make_closure(CallFrame* frame, ObjFunc* function, bool wide) {
+  ObjClose* closure = new_close(function);
+
+  push(OBJ_VAL(closure));
+
+  for (int i = 0; i < closure->upval_count; i++) {
+    uint8_t kind = *frame->ip++;
+    int index = *frame->ip++;
+
+    if (wide) {
+      index |= (frame->ip[0] << 8) | (frame->ip[1] << 16);
+      frame->ip += 2;
+    }
+
+    switch (kind) {
+      case CAPTURE_FLAT:
+        closure->upvals[i] = frame->slots[index];
+        break;
+      case CAPTURE_LOCAL:
+        closure->upvals[i] = OBJ_VAL(capture_upval(frame->slots + index));
+        break;
+      default:
+        closure->upvals[i] = frame->closure->upvals[index];
+        break;
+    }
+  }
+}
+
+// Also called by the code --emit-c generates, so they exist even without NVM_JIT.
+bool jit_get_global(ObjString* name) {
+  return get_global(name);
+}
+
+bool jit_get_prop(ObjString* name) {
+  return get_prop(name);
+}
+
+// 0 on an error, 1 if the call finished in place and 2 if it pushed a frame.
+int jit_call(int arg_count) {
+  int frame_count = vm.frame_count;
+
+  if (call_from(arg_count) == NULL) return 0;
+
+  return vm.frame_count == frame_count ? 1 : 2;
+}
+
+int jit_invoke(ObjString* name, int arg_count) {
+  int frame_count = vm.frame_count;
+
+  if (!invoke(name, arg_count)) return 0;
+
+  return vm.frame_count == frame_count ? 1 : 2;
+}
+
 static InterpResult run() {
   CallFrame* frame = &vm.frames[vm.frame_count - 1];
 
@@ -282,9 +558,14 @@ static InterpResult run() {
   #define READ_SHORT() \
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-    #define READ_CONST() \
-      (frame->closure->function->chunk.constants.values[READ_BYTE()])
+  #define READ_WIDE() \
+    (frame->ip += 3, \
+    (int)(frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)))
+  #define CONST_AT(index) \
+    (frame->closure->function->chunk.constants.values[index])
+  #define READ_CONST() CONST_AT(READ_BYTE())
   #define READ_STRING() AS_STRING(READ_CONST())
+  #define READ_WIDE_STRING() AS_STRING(CONST_AT(READ_WIDE()))
   #define BINARY_OP(value_type, op) \
     do { \
       if (!IS_NUM(peek(0)) || !IS_NUM(peek(1))) { \
@@ -295,6 +576,77 @@ static InterpResult run() {
       double a = AS_NUM(pop()); \
       push(value_type(a op b)); \
     } while (false)
+  // The register forms, with `right` read from a slot or a constant.
+  #define REG_BINARY_OP(value_type, op, right) \
+    do { \
+      Value a = frame->slots[READ_BYTE()]; \
+      Value b = right; \
+      if (!IS_NUM(a) || !IS_NUM(b)) { \
+        runtime_err("Operands must be numbers."); \
+        return INTERP_RUNTIME_ERR; \
+      } \
+      push(value_type(AS_NUM(a) op AS_NUM(b))); \
+    } while (false)
+  #define READ_REG() (frame->slots[READ_BYTE()])
+  // The number-only forms, which skip the checks.
+  #define NUM_BINARY_OP(value_type, op) \
+    do { \
+      double b = AS_NUM(pop()); \
+      vm.stack_top[-1] = value_type(AS_NUM(vm.stack_top[-1]) op b); \
+    } while (false)
+  bool native = vm.jit || vm.aot;
+
+  #ifdef STACK_CACHING
+  // Pushes onto the cached top, spilling the value cached before it.
+  #define CACHE_PUSH(value) \
+    do { \
+      if (cached) push(tos); \
+      tos = (value); \
+      cached = true; \
+    } while (false)
+  // Fast paths for numbers. Anything else breaks out to the usual handler.
+  #define CACHED_BINARY_OP(value_type, op) \
+    if (IS_NUM(tos) && IS_NUM(peek(0))) { \
+      tos = value_type(AS_NUM(pop()) op AS_NUM(tos)); \
+      continue; \
+    } \
+    break
+  // Operands are only consumed on the fast path, so the usual handler can reread them.
+  #define CACHED_REG_OP(value_type, op, right) \
+    { \
+      Value a = frame->slots[frame->ip[0]]; \
+      Value b = right; \
+      if (IS_NUM(a) && IS_NUM(b)) { \
+        frame->ip += 2; \
+        CACHE_PUSH(value_type(AS_NUM(a) op AS_NUM(b))); \
+        continue; \
+      } \
+      break; \
+    }
+  #define CACHED_REG_OPS() \
+    case OP_ADD_RR:     CACHED_REG_OP(NUM_VAL, +, frame->slots[frame->ip[1]]) \
+    case OP_ADD_RK:     CACHED_REG_OP(NUM_VAL, +, CONST_AT(frame->ip[1])) \
+    case OP_SUB_RR:     CACHED_REG_OP(NUM_VAL, -, frame->slots[frame->ip[1]]) \
+    case OP_SUB_RK:     CACHED_REG_OP(NUM_VAL, -, CONST_AT(frame->ip[1])) \
+    case OP_MUL_RR:     CACHED_REG_OP(NUM_VAL, *, frame->slots[frame->ip[1]]) \
+    case OP_MUL_RK:     CACHED_REG_OP(NUM_VAL, *, CONST_AT(frame->ip[1])) \
+    case OP_DIV_RR:     CACHED_REG_OP(NUM_VAL, /, frame->slots[frame->ip[1]]) \
+    case OP_DIV_RK:     CACHED_REG_OP(NUM_VAL, /, CONST_AT(frame->ip[1])) \
+    case OP_LESS_RR:    CACHED_REG_OP(BOOL_VAL, <, frame->slots[frame->ip[1]]) \
+    case OP_LESS_RK:    CACHED_REG_OP(BOOL_VAL, <, CONST_AT(frame->ip[1])) \
+    case OP_GREATER_RR: CACHED_REG_OP(BOOL_VAL, >, frame->slots[frame->ip[1]]) \
+    case OP_GREATER_RK: CACHED_REG_OP(BOOL_VAL, >, CONST_AT(frame->ip[1]))
+
+  /*
+    The top of the stack may be held in `tos` rather than in
+    memory. Common ops get a variant for each state, and any
+    other op finds the value flushed back before its usual
+    handler runs, so calls, natives and the collector only
+    ever see the real stack.
+  */
+  Value tos = NIL_VAL;
+  bool cached = false;
+  #endif
 
   for (;;) {
     #ifdef DEBUG_TRACE_EXEC
@@ -310,9 +662,93 @@ static InterpResult run() {
       disassemble_instruct(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
     #endif
 
-    uint8_t instruct;
+    // Native code runs until it needs run() for an instruction or a new frame.
+    if (native && (frame->closure->function->aot != NULL || frame->closure->function->jit != NULL)) {
+      #ifdef STACK_CACHING
+      if (cached) {
+        push(tos);
+        cached = false;
+      }
+      #endif
+
+      AotFn aot = frame->closure->function->aot;
+      JitStatus status = aot != NULL ? (JitStatus)aot(frame) : jit_run(frame);
+
+      if (status == JIT_ERROR) return INTERP_RUNTIME_ERR;
+
+      frame = &vm.frames[vm.frame_count - 1];
+
+      if (status == JIT_SWITCH) continue;
+    }
+
+    uint8_t instruct = READ_BYTE();
+
+    #ifdef STACK_CACHING
+    if (cached) {
+      switch (instruct) {
+        case OP_CONSTANT: CACHE_PUSH(READ_CONST()); continue;
+        case OP_NIL:      CACHE_PUSH(NIL_VAL); continue;
+        case OP_TRUE:     CACHE_PUSH(BOOL_VAL(true)); continue;
+        case OP_FALSE:    CACHE_PUSH(BOOL_VAL(false)); continue;
+        case OP_GET_LOCAL: CACHE_PUSH(READ_REG()); continue;
+        case OP_GET_FLAT: CACHE_PUSH(frame->closure->upvals[READ_BYTE()]); continue;
+        case OP_SET_LOCAL: READ_REG() = tos; continue;
+        case OP_STORE:    READ_REG() = tos; cached = false; continue;
+        case OP_POP:      cached = false; continue;
+        case OP_DUP:      push(tos); continue;
+        case OP_EQU:      tos = BOOL_VAL(value_equ(pop(), tos)); continue;
+        case OP_GREATER:  CACHED_BINARY_OP(BOOL_VAL, >);
+        case OP_LESS:     CACHED_BINARY_OP(BOOL_VAL, <);
+        case OP_ADD:      CACHED_BINARY_OP(NUM_VAL, +);
+        case OP_SUB:      CACHED_BINARY_OP(NUM_VAL, -);
+        case OP_MUL:      CACHED_BINARY_OP(NUM_VAL, *);
+        case OP_DIV:      CACHED_BINARY_OP(NUM_VAL, /);
+        case OP_NOT:      tos = BOOL_VAL(is_false(tos)); continue;
+        case OP_NEGATE:
+          if (!IS_NUM(tos)) break;
+
+          tos = NUM_VAL(-AS_NUM(tos));
+          continue;
+        case OP_PRINT:
+          print_val(tos);
+          printf("\n");
+          cached = false;
+          continue;
+        case OP_JUMP: {
+          uint16_t offset = READ_SHORT();
+
+          frame->ip += offset;
+          continue;
+        }
+        case OP_JUMP_IF_FALSE: {
+          uint16_t offset = READ_SHORT();
+
+          if (is_false(tos)) frame->ip += offset;
+          continue;
+        }
+        CACHED_REG_OPS()
+        default:
+          break;
+      }
+      push(tos);
+      cached = false;
+    }
+    else {
+      switch (instruct) {
+        case OP_CONSTANT: CACHE_PUSH(READ_CONST()); continue;
+        case OP_NIL:      CACHE_PUSH(NIL_VAL); continue;
+        case OP_TRUE:     CACHE_PUSH(BOOL_VAL(true)); continue;
+        case OP_FALSE:    CACHE_PUSH(BOOL_VAL(false)); continue;
+        case OP_GET_LOCAL: CACHE_PUSH(READ_REG()); continue;
+        case OP_GET_FLAT: CACHE_PUSH(frame->closure->upvals[READ_BYTE()]); continue;
+        CACHED_REG_OPS()
+        default:
+          break;
+      }
+    }
+    #endif
 
-    switch (instruct = READ_BYTE()) {
+    switch (instruct) {
       case OP_CONSTANT: {
         Value constant = READ_CONST();
 
@@ -338,92 +774,42 @@ static InterpResult run() {
 
         break;
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-
-        if (!get_table(&vm.globals, name, &value)) {
-          runtime_err("Undefined variable `%s`.", name->chars);
-          return INTERP_RUNTIME_ERR;
-        }
-
-        push(value);
-
+      case OP_CONSTANT_LONG:
+        push(CONST_AT(READ_WIDE()));
         break;
-      }
-      case OP_DEF_GLOBAL: {
-        ObjString* name = READ_STRING();
-
-        set_table(&vm.globals, name, peek(0));
+      case OP_GET_GLOBAL:
+        if (!get_global(READ_STRING())) return INTERP_RUNTIME_ERR;
+        break;
+      case OP_DEF_GLOBAL:
+        set_table(&vm.globals, READ_STRING(), peek(0));
         pop();
-
         break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-
-        if (set_table(&vm.globals, name, peek(0))) {
-          del_table(&vm.globals, name);
-          runtime_err("Undefined variable `%s`.", name->chars);
-          return INTERP_RUNTIME_ERR;
-        }
-
+      case OP_SET_GLOBAL:
+        if (!set_global(READ_STRING())) return INTERP_RUNTIME_ERR;
         break;
-      }
       case OP_GET_UPVAL: {
         uint8_t slot = READ_BYTE();
 
-        push(*frame->closure->upvals[slot]->location);
+        push(*AS_UPVAL(frame->closure->upvals[slot])->location);
 
         break;
       }
       case OP_SET_UPVAL: {
         uint8_t slot = READ_BYTE();
 
-        *frame->closure->upvals[slot]->location = peek(0);
+        *AS_UPVAL(frame->closure->upvals[slot])->location = peek(0);
 
         break;
       }
-      case OP_GET_PROP: {
-        if (!IS_INST(peek(0))) {
-          runtime_err("Only instances can have properties.");
-          return INTERP_RUNTIME_ERR;
-        }
-
-        ObjInst* inst = AS_INST(peek(0));
-        ObjString* name = READ_STRING();
-
-        Value value;
-
-        if (get_table(&inst->fields, name, &value)) {
-          pop();
-          push(value);
-
-          break;
-        }
-
-        if (!bind_method(inst->klass, name)) {
-          return INTERP_RUNTIME_ERR;
-        }
+      case OP_GET_FLAT:
+        push(frame->closure->upvals[READ_BYTE()]);
         break;
-      }
-      case OP_SET_PROP: {
-        if (!IS_INST(peek(1))) {
-          runtime_err("Only instances can have fields.");
-          return INTERP_RUNTIME_ERR;
-        }
-
-        ObjInst* inst = AS_INST(peek(1));
-
-        set_table(&inst->fields, READ_STRING(), peek(0));
-
-        Value value = pop();
-
-        pop();
-        push(value);
-
+      case OP_GET_PROP:
+        if (!get_prop(READ_STRING())) return INTERP_RUNTIME_ERR;
+        break;
+      case OP_SET_PROP:
+        if (!set_prop(READ_STRING())) return INTERP_RUNTIME_ERR;
         break;
-      }
       case OP_GET_SUPER: {
         ObjString* name = READ_STRING();
         ObjClass* superclass = AS_CLASS(pop());
@@ -463,6 +849,75 @@ static InterpResult run() {
       case OP_SUB:      BINARY_OP(NUM_VAL, -); break;
       case OP_MUL:      BINARY_OP(NUM_VAL, *); break;
       case OP_DIV:      BINARY_OP(NUM_VAL, /); break;
+      case OP_ADD_RR:
+      case OP_ADD_RK: {
+        Value a = READ_REG();
+        Value b = instruct == OP_ADD_RR ? READ_REG() : READ_CONST();
+
+        if (IS_NUM(a) && IS_NUM(b)) {
+          push(NUM_VAL(AS_NUM(a) + AS_NUM(b)));
+        }
+        else if (IS_STRING(a) && IS_STRING(b)) {
+          push(a);
+          push(b);
+          concat();
+        }
+        else {
+          runtime_err("Operands must be two numbers/two strings.");
+          return INTERP_RUNTIME_ERR;
+        }
+        break;
+      }
+      case OP_SUB_RR:     REG_BINARY_OP(NUM_VAL, -, READ_REG()); break;
+      case OP_SUB_RK:     REG_BINARY_OP(NUM_VAL, -, READ_CONST()); break;
+      case OP_MUL_RR:     REG_BINARY_OP(NUM_VAL, *, READ_REG()); break;
+      case OP_MUL_RK:     REG_BINARY_OP(NUM_VAL, *, READ_CONST()); break;
+      case OP_DIV_RR:     REG_BINARY_OP(NUM_VAL, /, READ_REG()); break;
+      case OP_DIV_RK:     REG_BINARY_OP(NUM_VAL, /, READ_CONST()); break;
+      case OP_LESS_RR:    REG_BINARY_OP(BOOL_VAL, <, READ_REG()); break;
+      case OP_LESS_RK:    REG_BINARY_OP(BOOL_VAL, <, READ_CONST()); break;
+      case OP_GREATER_RR: REG_BINARY_OP(BOOL_VAL, >, READ_REG()); break;
+      case OP_GREATER_RK: REG_BINARY_OP(BOOL_VAL, >, READ_CONST()); break;
+      case OP_EQU_RR:
+      case OP_EQU_RK: {
+        Value a = READ_REG();
+        Value b = instruct == OP_EQU_RR ? READ_REG() : READ_CONST();
+
+        push(BOOL_VAL(value_equ(a, b)));
+
+        break;
+      }
+      case OP_MOVE: {
+        uint8_t slot = READ_BYTE();
+
+        frame->slots[slot] = READ_REG();
+
+        break;
+      }
+      case OP_LOADK: {
+        uint8_t slot = READ_BYTE();
+
+        frame->slots[slot] = READ_CONST();
+
+        break;
+      }
+      case OP_STORE: {
+        uint8_t slot = READ_BYTE();
+
+        frame->slots[slot] = pop();
+
+        break;
+      }
+      case OP_ADD_NUM:     NUM_BINARY_OP(NUM_VAL, +); break;
+      case OP_SUB_NUM:     NUM_BINARY_OP(NUM_VAL, -); break;
+      case OP_MUL_NUM:     NUM_BINARY_OP(NUM_VAL, *); break;
+      case OP_DIV_NUM:     NUM_BINARY_OP(NUM_VAL, /); break;
+      case OP_LESS_NUM:    NUM_BINARY_OP(BOOL_VAL, <); break;
+      case OP_GREATER_NUM: NUM_BINARY_OP(BOOL_VAL, >); break;
+      case OP_EQU_NUM:     NUM_BINARY_OP(BOOL_VAL, ==); break;
+      case OP_NEGATE_NUM:
+        vm.stack_top[-1] = NUM_VAL(-AS_NUM(vm.stack_top[-1]));
+        break;
       case OP_DUP:      push(peek(0)); break;
       case OP_NOT:
         push(BOOL_VAL(is_false(pop())));
@@ -495,17 +950,60 @@ static InterpResult run() {
 
         break;
       }
-      case OP_CALL: {
-        int arg_count = READ_BYTE();
+      case OP_SWITCH_RANGE: {
+        int lo = (int16_t)READ_SHORT();
+        int count = READ_SHORT();
+        uint8_t* table = frame->ip;
+        Value value = peek(0);
+        int slot = 0;
 
-        if (!call_val(peek(arg_count), arg_count)) {
-          return INTERP_RUNTIME_ERR;
+        if (IS_NUM(value) && AS_NUM(value) >= lo && AS_NUM(value) < lo + count) {
+          double index = AS_NUM(value) - lo;
+
+          if (index == (int)index) slot = 2 + 2 * (int)index;
         }
 
-        frame = &vm.frames[vm.frame_count - 1];
+        frame->ip = table + 2 + 2 * count + ((table[slot] << 8) | table[slot + 1]);
+
+        break;
+      }
+      case OP_SWITCH_HASH: {
+        int capacity = READ_SHORT();
+        uint8_t* table = frame->ip;
+        Value value = peek(0);
+        uint8_t* jump = table;
+
+        if (IS_NUM(value) || IS_STRING(value)) {
+          int slot = hash_value(value) & (capacity - 1);
+
+          for (;;) {
+            uint8_t* entry = table + 2 + 4 * slot;
+            int constant = (entry[0] << 8) | entry[1];
+
+            if (constant == SWITCH_EMPTY) break;
+
+            if (value_equ(CONST_AT(constant), value)) {
+              jump = entry + 2;
+              break;
+            }
+
+            slot = (slot + 1) & (capacity - 1);
+          }
+        }
+
+        frame->ip = table + 2 + 4 * capacity + ((jump[0] << 8) | jump[1]);
 
         break;
       }
+      case OP_CALL:
+        if ((frame = call_from(READ_BYTE())) == NULL) return INTERP_RUNTIME_ERR;
+        break;
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3:
+        if ((frame = call_from(instruct - OP_CALL_0)) == NULL) return INTERP_RUNTIME_ERR;
+        break;
       case OP_INVOKE: {
         ObjString* method = READ_STRING();
         int arg_count = READ_BYTE();
@@ -531,23 +1029,21 @@ static InterpResult run() {
 
         break;
       }
-      case OP_CLOSURE: {
-        ObjFunc* function = AS_FUNC(READ_CONST());
-        ObjClose* closure = new_close(function);
-
-        push(OBJ_VAL(closure));
+      case OP_CLOSURE:
+        make_closure(frame, AS_FUNC(READ_CONST()), false);
+        break;
+      case OP_MEMO: {
+        int limit = (int)AS_NUM(pop());
+        ObjClose* closure = AS_CLOSURE(peek(0));
+        // The closure may be shared, so the memo goes on a copy.
+        ObjClose* memoized = new_close(closure->function);
 
         for (int i = 0; i < closure->upval_count; i++) {
-          uint8_t is_local = READ_BYTE();
-          uint8_t index = READ_BYTE();
-
-          if (is_local) {
-            closure->upvals[i] = capture_upval(frame->slots + index);
-          }
-          else {
-            closure->upvals[i] = frame->closure->upvals[index];
-          }
+          memoized->upvals[i] = closure->upvals[i];
         }
+        vm.stack_top[-1] = OBJ_VAL(memoized);
+        memoized->memo = new_memo(closure->function->arity, limit);
+
         break;
       }
       case OP_CLOSE_UPVAL:
@@ -559,6 +1055,10 @@ static InterpResult run() {
       case OP_RETURN: {
         Value result = pop();
 
+        if (frame->closure->memo != NULL) {
+          set_memo(frame->closure->memo, frame->memo_index, frame->memo_id, result);
+        }
+
         close_upvals(frame->slots);
 
         vm.frame_count--;
@@ -589,7 +1089,10 @@ static InterpResult run() {
 
         ObjClass* subclass = AS_CLASS(peek(0));
 
-        table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+        // Classes are closed once their body ends, so the table is
+        // shared rather than copied until the subclass defines a method.
+        subclass->methods_from = AS_CLASS(superclass)->methods_from;
+        subclass->initializer = AS_CLASS(superclass)->initializer;
 
         pop();
 
@@ -598,13 +1101,102 @@ static InterpResult run() {
       case OP_METHOD:
         def_method(READ_STRING());
         break;
+      case OP_WIDE:
+        switch (READ_BYTE()) {
+          case OP_CONSTANT: push(CONST_AT(READ_WIDE())); break;
+          case OP_GET_LOCAL: push(frame->slots[READ_WIDE()]); break;
+          case OP_SET_LOCAL: frame->slots[READ_WIDE()] = peek(0); break;
+          case OP_GET_GLOBAL:
+            if (!get_global(READ_WIDE_STRING())) return INTERP_RUNTIME_ERR;
+            break;
+          case OP_DEF_GLOBAL:
+            set_table(&vm.globals, READ_WIDE_STRING(), peek(0));
+            pop();
+            break;
+          case OP_SET_GLOBAL:
+            if (!set_global(READ_WIDE_STRING())) return INTERP_RUNTIME_ERR;
+            break;
+          case OP_GET_UPVAL:
+            push(*AS_UPVAL(frame->closure->upvals[READ_WIDE()])->location);
+            break;
+          case OP_SET_UPVAL:
+            *AS_UPVAL(frame->closure->upvals[READ_WIDE()])->location = peek(0);
+            break;
+          case OP_GET_FLAT:
+            push(frame->closure->upvals[READ_WIDE()]);
+            break;
+          case OP_GET_PROP:
+            if (!get_prop(READ_WIDE_STRING())) return INTERP_RUNTIME_ERR;
+            break;
+          case OP_SET_PROP:
+            if (!set_prop(READ_WIDE_STRING())) return INTERP_RUNTIME_ERR;
+            break;
+          case OP_GET_SUPER: {
+            ObjString* name = READ_WIDE_STRING();
+
+            if (!bind_method(AS_CLASS(pop()), name)) return INTERP_RUNTIME_ERR;
+            break;
+          }
+          case OP_JUMP: {
+            int offset = READ_WIDE();
+
+            frame->ip += offset;
+            break;
+          }
+          case OP_JUMP_IF_FALSE: {
+            int offset = READ_WIDE();
+
+            if (is_false(peek(0))) frame->ip += offset;
+            break;
+          }
+          case OP_INVOKE: {
+            ObjString* method = READ_WIDE_STRING();
+            int arg_count = READ_BYTE();
+
+            if (!invoke(method, arg_count)) return INTERP_RUNTIME_ERR;
+
+            frame = &vm.frames[vm.frame_count - 1];
+            break;
+          }
+          case OP_INVOKE_SUPER: {
+            ObjString* method = READ_WIDE_STRING();
+            int arg_count = READ_BYTE();
+
+            if (!invoke_from_class(AS_CLASS(pop()), method, arg_count)) return INTERP_RUNTIME_ERR;
+
+            frame = &vm.frames[vm.frame_count - 1];
+            break;
+          }
+          case OP_CLOSURE:
+            make_closure(frame, AS_FUNC(CONST_AT(READ_WIDE())), true);
+            break;
+          case OP_CLASS:
+            push(OBJ_VAL(new_class(READ_WIDE_STRING())));
+            break;
+          case OP_METHOD:
+            def_method(READ_WIDE_STRING());
+            break;
+        }
+        break;
     }
   }
   #undef READ_BYTE
   #undef READ_SHORT
+  #undef READ_WIDE
+  #undef CONST_AT
   #undef READ_CONST
   #undef READ_STRING
+  #undef READ_WIDE_STRING
   #undef BINARY_OP
+  #undef REG_BINARY_OP
+  #undef READ_REG
+  #undef NUM_BINARY_OP
+  #ifdef STACK_CACHING
+  #undef CACHE_PUSH
+  #undef CACHED_BINARY_OP
+  #undef CACHED_REG_OP
+  #undef CACHED_REG_OPS
+  #endif
 }
 
 InterpResult interp(const char* src) {
@@ -612,6 +1204,10 @@ InterpResult interp(const char* src) {
 
   if (function == NULL) return INTERP_COMPILE_ERR;
 
+  return interp_func(function);
+}
+
+InterpResult interp_func(ObjFunc* function) {
   push(OBJ_VAL(function));
 
   ObjClose* closure = new_close(function);
@@ -0,0 +1,79 @@
+#!/bin/sh
+# usage: tests/run.sh [mode...]
+#
+# Runs every tests/*.nvm under each mode and compares what it prints,
+# then what it reports on stderr, then its exit status, with its .out file.
+# A mode is `plain`, `cache`, which runs from a .nvmc file written by
+# --compile, `emit-c`, which builds the output of --emit-c against
+# libnvmbr.a, or a set of nvmbrc flags such as `--reg -O2`. Every mode
+# runs by default. Rebuild with -DSTACK_CACHING and rerun to check that
+# interpreter against the same files, or with -DDEBUG_STRESS_GC to collect
+# at every allocation.
+
+cd "$(dirname "$0")" || exit 1
+
+nvmbrc=../nvmbrc
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+[ $# -eq 0 ] && set -- plain cache -O2 --reg --lazy --jit emit-c
+
+# run <command...>: leaves the output in $tmp/got.
+run() {
+  "$@" >"$tmp/got" 2>"$tmp/err"
+  status=$?
+  cat "$tmp/err" >>"$tmp/got"
+  echo "exit $status" >>"$tmp/got"
+}
+
+for mode; do
+  case $mode in
+    plain|cache|emit-c) flags= ;;
+    *) flags=$mode ;;
+  esac
+
+  # The JIT only exists on some platforms.
+  if [ "$mode" = --jit ] && ! $nvmbrc --jit /dev/null >/dev/null 2>&1; then
+    echo "skip [$mode]"
+    continue
+  fi
+  if [ "$mode" = emit-c ] && [ ! -f ../libnvmbr.a ]; then
+    echo "skip [$mode], run \`make libnvmbr.a\` first"
+    continue
+  fi
+
+  count=0
+  for test in *.nvm; do
+    if [ "$mode" = cache ]; then
+      if $nvmbrc --compile "$test" >/dev/null 2>&1 && [ ! -f "${test}c" ]; then
+        echo "FAIL [$mode] $test wrote no ${test}c"
+        failed=1
+      fi
+      run $nvmbrc "$test"
+      rm -f "${test}c"
+    elif [ "$mode" = emit-c ]; then
+      # A script that doesn't compile reports the same errors from --emit-c.
+      cp "$test" "$tmp/prog.nvm"
+      run $nvmbrc --emit-c "$tmp/prog.nvm"
+      if [ -f "$tmp/prog.c" ]; then
+        ${CC:-cc} -O2 -I../src/include "$tmp/prog.c" ../libnvmbr.a -lm -o "$tmp/prog" &&
+        run "$tmp/prog"
+        rm -f "$tmp/prog.c" "$tmp/prog"
+      fi
+    else
+      run $nvmbrc $flags "$test"
+    fi
+
+    if ! diff "${test%.nvm}.out" "$tmp/got" >"$tmp/diff"; then
+      echo "FAIL [$mode] $test"
+      head -n 10 "$tmp/diff"
+      failed=1
+    fi
+    count=$((count + 1))
+  done
+
+  echo "ran $count [$mode]"
+done
+
+exit $failed